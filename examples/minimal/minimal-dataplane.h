@@ -1,166 +1,209 @@
 #include <map>
 #include <string>
+#include <string_view>
 #include <memory>
 #include <vector>
 #include <lua.hpp>
-#include <thread>
-#include <condition_variable>
+#include <functional>
 #include <glog/logging.h>
+#include <lvm2/delayed_actuator.h>
+#include <lvm2/lua_bind.h>
+#include <lvm2/typed_signal_table.h>
 
 #pragma once
 
 class minimal_dataplane {
 private:
-  minimal_dataplane(){}
+  minimal_dataplane()
+      : actuator_([this](handle_t h, lua_vm::signal_value value) { on_actuated(h, value); }) {
+  }
 public:
   ~minimal_dataplane(){
-    while(!pending_operations_.empty()){
-      LOG(INFO) << "Waiting for pending operations to complete";
-      std::this_thread::sleep_for(std::chrono::milliseconds(1000));
-    }
+    shutdown();
   }
 
   static std::unique_ptr<minimal_dataplane> make_unique() { return std::unique_ptr<minimal_dataplane>(new minimal_dataplane); }
   static void bind_lua(lua_State *L, minimal_dataplane* db){
-    // Store dataplane* as userdata in Lua state
-    minimal_dataplane **userdata1 = (minimal_dataplane **) lua_newuserdata(L, sizeof(minimal_dataplane *));
-    *userdata1 = db;
-    lua_setglobal(L, "THIS_DATAPLANE");
-
+    // the functions get db as upvalue, see this_lua_database()
     luaL_Reg actuator_funcs[] = {
-        {"get", l_get},
-        {"set", l_set_delayed},
+        lua_vm::bind<&minimal_dataplane::lua_get>("get"),
+        lua_vm::bind<&minimal_dataplane::lua_set_delayed>("set"),
+        lua_vm::bind<&minimal_dataplane::lua_handle>("handle"),
+        {"subscribe", l_subscribe},
+        {"on_change", l_subscribe},
         {NULL, NULL} // Sentinel to indicate the end of the array
     };
-    luaL_newlib(L, actuator_funcs);
-    lua_setglobal(L, "actuator");
+    lua_vm::register_library(L, "actuator", actuator_funcs, db);
 
     luaL_Reg sensor_funcs[] = {
-        {"get", l_get},
+        lua_vm::bind<&minimal_dataplane::lua_get>("get"),
+        lua_vm::bind<&minimal_dataplane::lua_handle>("handle"),
+        {"subscribe", l_subscribe},
+        {"on_change", l_subscribe},
         {NULL, NULL} // Sentinel to indicate the end of the array
     };
-    luaL_newlib(L, sensor_funcs);
-    lua_setglobal(L, "sensor");
+    lua_vm::register_library(L, "sensor", sensor_funcs, db);
 
     luaL_Reg signal_funcs[] = {
-        {"get", l_get},
-        {"set", l_set},
+        lua_vm::bind<&minimal_dataplane::lua_get>("get"),
+        lua_vm::bind<&minimal_dataplane::lua_set>("set"),
+        lua_vm::bind<&minimal_dataplane::lua_handle>("handle"),
+        {"subscribe", l_subscribe},
+        {"on_change", l_subscribe},
         {NULL, NULL} // Sentinel to indicate the end of the array
     };
-    luaL_newlib(L, signal_funcs);
-    lua_setglobal(L, "signal");
+    lua_vm::register_library(L, "signal", signal_funcs, db);
   }
 
-  typedef std::map<std::string, int64_t> storage_type_t;
+  typedef lua_vm::typed_signal_table storage_type_t;
+  typedef storage_type_t::handle_t handle_t;
 
+  // a signal of the catalog, writes out of [min, max] are rejected
   struct init_entry_t {
     std::string name;
     int64_t value;
     int64_t min;
     int64_t max;
-
+    lua_vm::signal_type type = lua_vm::signal_type::INTEGER; // value is converted, strings start empty
   };
 
+  // registers the signal catalog, scripts can only read and write these signals
   void initialize(const std::vector<init_entry_t> &entries)
   {
-    for (const auto &entry : entries)
-      storage_[entry.name] = entry.value;
+    storage_.reserve(entries.size());
+    for (const auto &entry : entries) {
+      auto h = storage_.add(entry.name, {entry.type, (double) entry.min, (double) entry.max});
+      if (entry.type == lua_vm::signal_type::BOOLEAN)
+        storage_.set(h, entry.value != 0);
+      else if (entry.type != lua_vm::signal_type::STRING)
+        storage_.set(h, entry.value);
+    }
+  }
+
+  inline handle_t handle(std::string_view name) const {
+    return storage_.handle(name);
+  }
+
+  // throws if value has another type than the signal or is out of its bounds
+  template<typename T>
+  inline void set(handle_t h, T value){
+    if (storage_.set(h, value))
+      notify(h);
+  }
+
+  template<typename T>
+  inline void set(std::string_view name, T value){
+    set(handle(name), value);
   }
 
-  void set( std::string name, int64_t value){
-    storage_[name] = value;
+  inline lua_vm::signal_value get(handle_t h) const {
+    return storage_.get(h);
   }
 
-  int64_t get( std::string name){
-    auto item = storage_.find(name);
-    if (item != storage_.end())
-      return item->second;
-    throw std::out_of_range("Element: " + name + " not found in collection");
+  inline lua_vm::signal_value get(std::string_view name) const {
+    return get(handle(name));
   }
 
   std::vector<std::string> get_signal_names() const {
-    std::vector<std::string> names;
-    for (const auto& entry : storage_) {
-      names.push_back(entry.first);
-    }
-    return names;
+    return storage_.names();
   }
 
-private:
-  static inline minimal_dataplane *this_lua_database(lua_State *L) {
-    lua_getglobal(L, "THIS_DATAPLANE");
-    minimal_dataplane *db = *(minimal_dataplane **) lua_touserdata(L, -1);
-    lua_pop(L, 1); // Pop userdata from stack
-    return db;
-  }
-
-  static int l_set(lua_State *L){
-    try {
-      auto db = this_lua_database(L);
-      const char *name = luaL_checkstring(L, 1);
-      int64_t value = luaL_checkinteger(L, 2);
-      db->set(name, value);
-      return 0;
-    } catch (std::exception& e){
-      return luaL_error(L, "exception '%s'", e.what());
-    }
+  // Called with the event of a changed signal that scripts subscribed to, typically executor::post_event. Set it
+  // before scripts run.
+  void set_change_notifier(std::function<void(int)> notifier){
+    change_notifier_ = std::move(notifier);
   }
 
-  static int l_get(lua_State *L){
-    try {
-      auto db = this_lua_database(L);
-      const char *name = luaL_checkstring(L, 1);
-      int64_t value = db->get(name);
-      lua_pushinteger(L, value);
-      return 1;
-    } catch (std::exception& e){
-      return luaL_error(L, "exception '%s'", e.what());
-    }
+  // Called after any signal changed, typically executor::notify_change so that await() conditions are checked
+  // again. Set it before scripts run.
+  void set_any_change_notifier(std::function<void()> notifier){
+    any_change_notifier_ = std::move(notifier);
   }
 
+  // Called on the actuation thread after a delayed actuator.set() has reached its value, e.g. to post an executor
+  // event. Set it before scripts run.
+  void set_actuation_listener(std::function<void(handle_t, lua_vm::signal_value)> listener){
+    actuation_listener_ = std::move(listener);
+  }
+
+  inline void set_actuation_delay(std::chrono::milliseconds delay){
+    actuation_delay_ = delay;
+  }
 
-  inline static int l_set_delayed(lua_State *L) {
-    try {
-      auto db = this_lua_database(L);
+  inline size_t nr_of_pending_actuations() const {
+    return actuator_.nr_pending();
+  }
 
-      const char *name = luaL_checkstring(L, 1);
-      int64_t value = luaL_checkinteger(L, 2);
+  // completes the pending actuations and stops the actuation thread, call it while the actuation listener is
+  // still valid
+  void shutdown(){
+    if (actuator_.nr_pending())
+      LOG(INFO) << "Waiting for " << actuator_.nr_pending() << " pending actuations to complete";
+    actuator_.shutdown(true);
+  }
 
-      std::unique_lock<std::mutex> lock(db->pending_op_mutex_);
-      auto &entry = db->pending_operations_[name];
+  // lock free for observer threads, calls fn(handle, signal_value) for the signals written after version
+  template<typename F>
+  uint64_t changes_since(uint64_t version, F &&fn) const {
+    return storage_.changes_since(version, std::forward<F>(fn));
+  }
 
-      // Check if there's already a pending operation with the same value
-      if (entry.first == value) {
-        // There's already a pending operation to set this value, return immediately
-        return 0;
-      }
+private:
+  // only valid in the functions registered by bind_lua()
+  static inline minimal_dataplane *this_lua_database(lua_State *L) {
+    return lua_vm::bound_object<minimal_dataplane>(L);
+  }
 
+  inline void notify(handle_t h){
+    int eventid = storage_.event(h);
+    if (eventid >= 0 && change_notifier_)
+      change_notifier_(eventid);
+    if (any_change_notifier_)
+      any_change_notifier_();
+  }
 
-      // Update the pending operation
-      entry.first = value;
+  // Lua API, signals are addressed by a handle from handle() or by name
+  handle_t lua_handle(lua_vm::handle_or_name key) const {
+    return key.is_handle() ? storage_.checked(key.handle) : storage_.handle(key.name);
+  }
 
-      // Use a condition variable to wait instead of creating a new thread
-      auto &cond_var = entry.second;
-      std::thread([db, name, value, &cond_var]() {
-        std::this_thread::sleep_for(std::chrono::seconds(2)); // Wait for 1 second
+  // get(signal) returns an integer, number, boolean or string as the signal was registered
+  int lua_get(lua_State *L){
+    storage_.lua_push(L, storage_.lua_check_handle(L, 1));
+    return 1;
+  }
 
-        {
-          std::lock_guard<std::mutex> guard(db->pending_op_mutex_);
-          db->set(name, value); // Perform the set operation
-          db->pending_operations_.erase(name); // Remove the pending operation
-        }
+  // set(signal, value), value must have the type of the signal
+  int lua_set(lua_State *L){
+    handle_t h = storage_.lua_check_handle(L, 1);
+    set(h, storage_.lua_check_value(L, h, 2));
+    return 0;
+  }
 
-        cond_var.notify_all(); // Notify any waiting threads
-      }).detach();
+  // the value is checked now, not when the actuator reaches it
+  int lua_set_delayed(lua_State *L){
+    handle_t h = storage_.lua_check_handle(L, 1);
+    auto value = storage_.lua_check_value(L, h, 2);
+    storage_.validate(h, value);
+    actuator_.schedule(h, value, actuation_delay_);
+    return 0;
+  }
 
-      return 0;
-    } catch (std::exception &e) {
-      return luaL_error(L, "exception '%s'", e.what());
-    }
+  // subscribe(signal, fn) / on_change(signal, fn), fn(value) runs when the signal changed
+  static int l_subscribe(lua_State *L){
+    return this_lua_database(L)->storage_.lua_subscribe(L);
   }
 
+  void on_actuated(handle_t h, lua_vm::signal_value value){
+    set(h, value);
+    if (actuation_listener_)
+      actuation_listener_(h, value);
+  }
 
-  std::mutex pending_op_mutex_;
-  std::map<std::string, std::pair<int64_t, std::condition_variable>> pending_operations_;
   storage_type_t storage_;
+  std::function<void(int)> change_notifier_;
+  std::function<void()> any_change_notifier_;
+  std::function<void(handle_t, lua_vm::signal_value)> actuation_listener_;
+  std::chrono::milliseconds actuation_delay_ = std::chrono::seconds(2);
+  lua_vm::delayed_actuator<handle_t, lua_vm::signal_value> actuator_; // last, its thread uses the members above
 };
@@ -1,4 +1,5 @@
 #include <QApplication>
+#include <cstdlib>
 #include <thread>
 #include <glog/logging.h>
 #include <lvm2/executor.h>
@@ -12,6 +13,11 @@ static bool exit_ = false;
 int main(int argc, char **argv) {
   QApplication app(argc, argv);
 
+  // LVM2_TRACE=<file> writes a Chrome trace of the executor ticks on exit
+  const char *trace_file = getenv("LVM2_TRACE");
+  if (trace_file)
+    lua_vm::tracer::start();
+
   std::vector<minimal_dataplane::init_entry_t> default_data = {
       {"vehicle.Cabin.Door.Row1.Left.IsOpen", 0,  0,  1},
       {"vehicle.Cabin.Lights.IsDomeOn", 0,  0,  1},
@@ -32,22 +38,35 @@ int main(int argc, char **argv) {
   auto executor = lua_vm::executor::make_unique([&](auto L) {
     minimal_dataplane::bind_lua(L, db.get());
   });
+  // signal.subscribe() handlers run when the dataplane reports a change
+  db->set_change_notifier([&executor](int eventid) {
+    executor->post_event(eventid);
+  });
+  // await() in scripts parks until a signal changed
+  db->set_any_change_notifier([&executor] {
+    executor->notify_change();
+  });
+  executor->enable_watchdog(); // no count hook in healthy scripts
   executor->load_scripts("../../../examples/minimal/scripts");
+  // scripts can subscribe to "actuator.done" instead of polling for delayed actuations to complete
+  int actuator_done = executor->event_open("actuator.done");
+  db->set_actuation_listener([&executor, actuator_done](auto, auto) {
+    executor->post_event(actuator_done);
+  });
   // Use a separate thread to run the executor loop if it should be independent of the GUI
   std::thread executorThread([&] {
-    while (!exit_) {
-      executor->run_loop();
-      std::this_thread::sleep_for(100ms);
-    }
+    executor->run_forever();
   });
 
   std::thread visuliserThread([&] {
+    uint64_t version = 0;
     while (!exit_) {
-      for (auto i: signal_names) {
-        auto value = db->get(i);
+      // only the signals that changed since the last refresh, read without blocking the executor
+      version = db->changes_since(version, [&](auto handle, lua_vm::signal_value value) {
         QMetaObject::invokeMethod(widget, "signalValueUpdated", Qt::QueuedConnection,
-                                  Q_ARG(QString, QString::fromStdString(i)), Q_ARG(int, value));
-      }
+                                  Q_ARG(QString, QString::fromStdString(signal_names[handle])),
+                                  Q_ARG(int, (int) value.as_number()));
+      });
       std::this_thread::sleep_for(100ms);
     }
   });
@@ -57,9 +76,18 @@ int main(int argc, char **argv) {
   // Start the Qt event loop
   int result = app.exec();
   exit_ = true;
+  executor->stop();
   // Make sure to join your threads before exiting
   executorThread.join();
   visuliserThread.join();
+  // completes the pending actuations while the executor they notify still exists
+  db->shutdown();
+
+  if (trace_file) {
+    lua_vm::tracer::stop();
+    if (!lua_vm::tracer::write_chrome_json(trace_file))
+      LOG(ERROR) << "cannot write trace to " << trace_file;
+  }
 
   return result;
 
@@ -24,17 +24,14 @@ local function passenger_welcome()
     return true
 end
 
---co = nil
-
 function init()
-    co = coroutine.create(passenger_welcome)
+    -- runs when the signal changes instead of polling it every loop
+    signal.subscribe("passenger.approaching", function(approaching)
+        if approaching == 1 then
+            task.spawn(passenger_welcome)
+        end
+    end)
 end
 
 function loop()
-    if coroutine.status(co) ~= 'dead' then
-        local success, errorMsg = coroutine.resume(co)
-        if not success then
-            error(errorMsg) -- Propagate the error up
-        end
-    end
 end
@@ -23,22 +23,9 @@ end
 
 
 function init()
-    co1 = coroutine.create(passenger_sim)
-    co2 = coroutine.create(env_sim)
+    task.spawn(passenger_sim)
+    task.spawn(env_sim)
 end
 
 function loop()
-    if coroutine.status(co1) ~= 'dead' then
-        local success, errorMsg = coroutine.resume(co1)
-        if not success then
-            error(errorMsg) -- Propagate the error up
-        end
-    end
-
-    if coroutine.status(co2) ~= 'dead' then
-        local success, errorMsg = coroutine.resume(co2)
-        if not success then
-            error(errorMsg) -- Propagate the error up
-        end
-    end
 end
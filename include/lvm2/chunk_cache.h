@@ -0,0 +1,81 @@
+#include <atomic>
+#include <cstdint>
+#include <list>
+#include <lua.hpp>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#pragma once
+
+namespace lua_vm {
+  /*
+   * Cache of compiled Lua chunks (lua_dump output) keyed by a hash of chunk name and source, so a script that was
+   * compiled once is instantiated from bytecode afterwards. With a cache directory the chunks also survive restarts;
+   * a file is only used if its header matches the Lua version, the source length and the full key. In memory the
+   * least recently used chunks are dropped beyond memory_limit bytes, files are kept. Thread safe.
+   */
+  class chunk_cache {
+  public:
+    static constexpr size_t default_memory_limit = 16 * 1024 * 1024;
+
+    explicit chunk_cache(std::string cache_dir = "", size_t memory_limit = default_memory_limit);
+
+    // Same contract as luaL_loadbuffer: pushes the compiled chunk (or an error message) and returns the status
+    int load(lua_State *L, std::string_view source, const std::string &chunkname);
+
+    inline size_t hits() const {
+      return hits_;
+    }
+
+    inline size_t misses() const {
+      return misses_;
+    }
+
+    // number of chunks held in memory
+    size_t size() const;
+
+    // bytecode held in memory
+    size_t bytes() const;
+
+    static uint64_t hash(std::string_view chunkname, std::string_view source);
+
+    // drops the chunk of key from memory and from the cache directory, e.g. once its script was replaced
+    inline void evict(uint64_t key) {
+      drop(key);
+    }
+
+    // drops the chunk of key from memory only, e.g. once no script loaded from it is left
+    void release(uint64_t key);
+
+  private:
+    std::shared_ptr<const std::string> find(uint64_t key, size_t source_length);
+
+    void store(uint64_t key, size_t source_length, std::shared_ptr<const std::string> bytecode);
+
+    void drop(uint64_t key);
+
+    std::string path_of(uint64_t key) const;
+
+    // mutex_ must be held
+    void insert(uint64_t key, std::shared_ptr<const std::string> bytecode);
+
+    // mutex_ must be held
+    void erase(uint64_t key);
+
+    struct entry {
+      std::shared_ptr<const std::string> bytecode;
+      std::list<uint64_t>::iterator lru;
+    };
+
+    std::string cache_dir_;
+    const size_t memory_limit_;
+    mutable std::mutex mutex_;
+    std::unordered_map<uint64_t, entry> chunks_;
+    std::list<uint64_t> lru_; // most recently used first
+    size_t bytes_ = 0;
+    std::atomic<size_t> hits_ = 0;
+    std::atomic<size_t> misses_ = 0;
+  };
+} // namespace lua_vm
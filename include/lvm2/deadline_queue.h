@@ -0,0 +1,67 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <vector>
+#pragma once
+
+namespace lua_vm {
+  /*
+   * Min-heap of (deadline, key) pairs.
+   *
+   * Entries are never updated in place. Each entry carries the generation of the object it was pushed for, when the
+   * object is re-armed or stopped it bumps its generation and the old entry is recognized as stale when it pops.
+   */
+  template<typename Key, typename Clock = std::chrono::steady_clock>
+  class deadline_queue {
+  public:
+    typedef typename Clock::time_point time_point;
+
+    struct entry {
+      time_point deadline;
+      Key key;
+      uint64_t generation;
+    };
+
+    inline void push(time_point deadline, Key key, uint64_t generation) {
+      heap_.push_back(entry{deadline, key, generation});
+      std::push_heap(heap_.begin(), heap_.end(), later);
+    }
+
+    inline bool empty() const {
+      return heap_.empty();
+    }
+
+    inline size_t size() const {
+      return heap_.size();
+    }
+
+    // only valid if !empty()
+    inline time_point next_deadline() const {
+      return heap_.front().deadline;
+    }
+
+    // Moves all entries with deadline <= now to due (in deadline order). Callers re-arm after the call, so an
+    // entry that is due again immediately is not popped twice in the same round.
+    void pop_due(time_point now, std::vector<entry> &due) {
+      while (!heap_.empty() && heap_.front().deadline <= now) {
+        std::pop_heap(heap_.begin(), heap_.end(), later);
+        due.push_back(heap_.back());
+        heap_.pop_back();
+      }
+    }
+
+    // Drops all entries where pred(entry) is true, O(n)
+    template<typename Pred>
+    void remove_if(Pred pred) {
+      heap_.erase(std::remove_if(heap_.begin(), heap_.end(), pred), heap_.end());
+      std::make_heap(heap_.begin(), heap_.end(), later);
+    }
+
+  private:
+    static inline bool later(const entry &a, const entry &b) {
+      return a.deadline > b.deadline;
+    }
+
+    std::vector<entry> heap_;
+  };
+} // namespace lua_vm
@@ -0,0 +1,130 @@
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "deadline_queue.h"
+#pragma once
+
+namespace lua_vm {
+  /*
+   * Applies actuations (key = value) after a delay, e.g. to model actuators that take time to move.
+   *
+   * One worker thread owns a deadline ordered queue of all pending actuations, so scheduling costs no thread and
+   * no stack. Scheduling a key that is already pending coalesces: the same value is ignored, a new value replaces
+   * the pending one and restarts its delay.
+   */
+  template<typename Key, typename Value>
+  class delayed_actuator {
+  public:
+    // called on the worker thread when an actuation is due
+    typedef std::function<void(Key, Value)> apply_fn;
+
+    explicit delayed_actuator(apply_fn apply)
+        : apply_(std::move(apply)), worker_(&delayed_actuator::worker_main, this) {
+    }
+
+    ~delayed_actuator() {
+      shutdown(true);
+    }
+
+    delayed_actuator(const delayed_actuator &) = delete;
+
+    delayed_actuator &operator=(const delayed_actuator &) = delete;
+
+    void schedule(Key key, Value value, std::chrono::milliseconds delay) {
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (stopping_)
+          return;
+        auto it = pending_.find(key);
+        if (it != pending_.end() && it->second.value == value)
+          return; // already on its way
+        auto &p = pending_[key];
+        p.value = value;
+        p.generation = ++generation_;
+        queue_.push(std::chrono::steady_clock::now() + delay, key, p.generation);
+      }
+      cv_.notify_one();
+    }
+
+    bool is_pending(Key key) const {
+      std::lock_guard<std::mutex> lock(mutex_);
+      return pending_.find(key) != pending_.end();
+    }
+
+    size_t nr_pending() const {
+      std::lock_guard<std::mutex> lock(mutex_);
+      return pending_.size();
+    }
+
+    // Stops the worker. With drain the pending actuations are still applied at their deadline, otherwise they are
+    // dropped. Idempotent.
+    void shutdown(bool drain) {
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stopping_ = true;
+        if (!drain) {
+          pending_.clear();
+          queue_ = deadline_queue<Key>();
+        }
+      }
+      cv_.notify_one();
+      if (worker_.joinable())
+        worker_.join();
+    }
+
+  private:
+    struct pending_actuation {
+      Value value;
+      uint64_t generation;
+    };
+
+    void worker_main() {
+      std::vector<typename deadline_queue<Key>::entry> due;
+      std::vector<std::pair<Key, Value>> ready;
+      std::unique_lock<std::mutex> lock(mutex_);
+      for (;;) {
+        if (queue_.empty()) {
+          if (stopping_)
+            return;
+          cv_.wait(lock);
+          continue;
+        }
+
+        auto now = std::chrono::steady_clock::now();
+        if (queue_.next_deadline() > now) {
+          cv_.wait_until(lock, queue_.next_deadline());
+          continue;
+        }
+
+        due.clear();
+        queue_.pop_due(now, due);
+        ready.clear();
+        for (auto &entry: due) {
+          auto it = pending_.find(entry.key);
+          if (it == pending_.end() || it->second.generation != entry.generation)
+            continue; // replaced by a later schedule()
+          ready.emplace_back(entry.key, it->second.value);
+          pending_.erase(it);
+        }
+
+        lock.unlock();
+        for (auto &[key, value]: ready)
+          apply_(key, value);
+        lock.lock();
+      }
+    }
+
+    apply_fn apply_;
+    mutable std::mutex mutex_;
+    std::condition_variable cv_;
+    std::map<Key, pending_actuation> pending_;
+    deadline_queue<Key> queue_;
+    uint64_t generation_ = 0;
+    bool stopping_ = false;
+    std::thread worker_; // last, starts after the members above are initialized
+  };
+} // namespace lua_vm
@@ -0,0 +1,46 @@
+#include <cstdint>
+#include <lua.hpp>
+#include <memory>
+#include <string>
+#include <string_view>
+#pragma once
+
+namespace lua_vm {
+  class event_payload;
+
+  // payloads are immutable once built, one copy is shared by all subscribers of an event
+  typedef std::shared_ptr<const event_payload> event_payload_ptr;
+
+  /*
+   * Value published with an event: nil, a boolean, an integer, a number, a string or a table of those (nested up to
+   * max_depth), serialized to a compact binary form. It is built once by the publisher and decoded into the state of
+   * each subscriber, so no Lua value crosses states.
+   */
+  class event_payload {
+  public:
+    static constexpr int max_depth = 16;
+
+    // Serializes the value at idx of L. Throws std::invalid_argument for functions, userdata, threads and tables
+    // nested deeper than max_depth (including cyclic ones).
+    static event_payload_ptr from_lua(lua_State *L, int idx);
+
+    static event_payload_ptr of(bool value);
+    static event_payload_ptr of(lua_Integer value);
+    static event_payload_ptr of(lua_Number value);
+    static event_payload_ptr of(std::string_view value);
+
+    // Pushes the decoded value onto L in protected mode. Returns the lua_pcall() status, on error the message is
+    // pushed instead (e.g. the script's memory quota was hit).
+    int push(lua_State *L) const;
+
+    // size of the serialized form in bytes
+    inline size_t size() const {
+      return bytes_.size();
+    }
+
+  private:
+    static int push_unprotected(lua_State *L);
+
+    std::string bytes_;
+  };
+} // namespace lua_vm
@@ -1,14 +1,33 @@
+#include <atomic>
 #include <chrono>
+#include <condition_variable>
+#include <deque>
 #include <functional>
 #include <lua.hpp>
 #include <map>
 #include <memory>
+#include <mutex>
+#include <optional>
 #include <queue>
 #include <set>
 #include <string>
 #include <vector>
 #include <list>
 #include "stdexcept"
+#include "chunk_cache.h"
+#include "deadline_queue.h"
+#include "event_payload.h"
+#include "lua_binding.h"
+#include "mpsc_queue.h"
+#include "lua_profiler.h"
+#include "script_allocator.h"
+#include "script_budget.h"
+#include "script_metrics.h"
+#include "script_watcher.h"
+#include "string_hash.h"
+#include "trace.h"
+#include "watchdog.h"
+#include "worker_pool.h"
 #pragma once
 
 /*
@@ -31,27 +50,37 @@ namespace lua_vm {
       duration_ = duration;
       start_ = std::chrono::steady_clock::now();// todo wrong clock if we simulate...
       running_ = true;
+      ++generation_;
     }
 
     // Reset the timer to the initial duration
     inline void restart() {
-      start_ = std::chrono::steady_clock::now();  // todo wrong clock if we simulate...
+      restart(std::chrono::steady_clock::now());  // todo wrong clock if we simulate...
+    }
+
+    inline void restart(std::chrono::steady_clock::time_point now) {
+      start_ = now;
       running_ = true;
+      ++generation_;
     }
 
     inline void stop() {
       running_ = false;
+      ++generation_;
     }
 
     // Check if the timer has elapsed - only works once for each period
     inline bool elapsed() {
+      return elapsed(std::chrono::steady_clock::now());
+    }
+
+    inline bool elapsed(std::chrono::steady_clock::time_point now) {
       if (!running_)
         return false;
 
-      auto now = std::chrono::steady_clock::now();
       if (now - start_ >= duration_) {
         if (type_ == PERIODIC)
-          restart();
+          restart(now);
         else
           stop();
         return true;
@@ -59,6 +88,19 @@ namespace lua_vm {
       return false;
     }
 
+    inline bool is_running() const {
+      return running_;
+    }
+
+    inline std::chrono::steady_clock::time_point deadline() const {
+      return start_ + duration_;
+    }
+
+    // bumped whenever the deadline changes or the timer stops, used to drop stale deadline_queue entries
+    inline uint64_t generation() const {
+      return generation_;
+    }
+
     inline bool is_active() const {
       return running_ && (remaining() > std::chrono::milliseconds(0));
     }
@@ -88,34 +130,152 @@ namespace lua_vm {
     std::chrono::steady_clock::time_point start_;
     std::chrono::milliseconds duration_;
     bool running_;
+    uint64_t generation_ = 0;
   };
 
   class executor;
 
+  // Coroutine registered with task.spawn(), only resumed by the executor when it is runnable. A SLEEPING task waits
+  // for wake_at, an AWAITING one for the next event or timer delivered to its script or executor::notify_change(),
+  // and checks its condition again after 100 ms at the latest.
+  struct lua_task {
+    enum state_t {
+      RUNNABLE, SLEEPING, AWAITING
+    };
+
+    lua_State *co;
+    int ref;                     // registry reference keeping the thread alive
+    int nargs;                   // arguments waiting on the thread's stack for the first resume
+    state_t state = RUNNABLE;
+    int await_ref = LUA_NOREF;   // predicate the task waits for in AWAITING, LUA_NOREF for await(value)
+    std::chrono::steady_clock::time_point wake_at;
+    uint64_t generation = 0;     // bumped whenever the task runs, wakeups queued before are stale
+  };
+
   struct lua_script {
-    lua_script(executor *);
+    // prewarmed is a state from executor::new_lua_state(), a new one is created if nullptr
+    lua_script(executor *, lua_State *prewarmed = nullptr);
 
     ~lua_script();
 
     bool loadAndReferenceFunction(const std::string &functionName, int &functionRef);
 
-    bool loadAndExecuteFile(const std::string &path);
-    bool loadAndExecuteFromBuffer(const std::string &buffer);
+    bool loadAndExecuteFile(const std::string &path, chunk_cache *cache = nullptr);
+    bool loadAndExecuteFromBuffer(const std::string &buffer, chunk_cache *cache = nullptr);
 
-    void event_publish(int eventid);
+    void event_publish(int eventid, const event_payload_ptr &payload);
 
     void handle_timer_elapsed(int id);
 
     bool handle_lua_callbacks();
 
+    // Calls a handler in the CALLBACK phase. count is 0 for a single occurrence, otherwise the number of occurrences
+    // coalesced into batch (if not nullptr) or payload.
+    bool call_event_handler(lua_Integer ref, int eventid, const event_payload_ptr &payload,
+                            std::vector<event_payload_ptr> *batch = nullptr, size_t count = 0);
+
+    int task_spawn(lua_State *co, int ref, int nargs);
+
+    void task_wake(int id);
+
+    // parks an awaiting task until something is delivered to the script, see lua_task
+    void task_await(int id);
+
+    // re-checks an awaiting task in the next tick, unless it was woken meanwhile
+    void task_recheck(int id);
+
+    // makes the awaiting tasks runnable, queue_mutex must be held
+    void wake_awaiting();
+
+    void set_name(const std::string &script_name);
+
+    // instructions between calls of the count hook, for the script's state and its tasks
+    void set_hook_count(int count);
+
+    enum phase_t {
+      IDLE, INIT, LOOP, CALLBACK
+    };
+
+    // starts the budget of a phase, the count hook interrupts or reports it when it runs over
+    void begin_phase(phase_t p);
+
+    void end_phase();
+
+    // Called by the watchdog: makes the Lua threads of the script raise a timeout error if phase seq is still running
+    void preempt(uint64_t seq);
+
+    // resume of a coroutine that the watchdog can preempt, same results as lua_resume()
+    int resume_tracked(lua_State *co, lua_State *from, int narg, int *nresults);
+
+    executor *exec;
+    std::string name; // file name, or the name given to executor::loadScriptFromBuffer()
+    const char *trace_name = "script"; // interned name for tracer spans
+    uint64_t chunk_key = 0; // of the script's chunk in the chunk cache, 0 if it was not loaded through it
     lua_State *L;
+    std::unique_ptr<script_allocator> allocator; // owned by the script, freed after lua_close(L)
     int initFunctionRef;
     int loopFunctionRef;
     std::chrono::high_resolution_clock::time_point ts_begin_loop;
-    std::queue<int> event_queue;
+    std::mutex queue_mutex; // guards event_queue and elapsed_timers, other threads may deliver to them
+    struct queued_event {
+      int id;
+      event_payload_ptr payload; // nullptr if published without a value
+    };
+    std::queue<queued_event> event_queue;
     std::list<int> elapsed_timers;
     std::map<int, lua_Integer> timer_handlers;
-    std::map<int, lua_Integer> event_handlers;
+    struct event_handler {
+      enum mode_t {
+        EACH,   // fn(id, payload) per occurrence
+        BATCH,  // fn(id, payloads, count) once per tick with all occurrences since the last call
+        LATEST  // fn(id, payload, count) once per tick with the newest occurrence only
+      };
+      lua_Integer ref;
+      mode_t mode = EACH;
+      bool library = false; // added by lua_event_subscribe(), e.g. signal.subscribe
+    };
+    // Per event the handler of event.subscribe, which the next event.subscribe replaces, and all handlers added by
+    // libraries, in subscription order
+    std::map<int, std::vector<event_handler>> event_handlers;
+    // reverse index of executor::event_subscribers_ and timer_subscribers_, guarded by the executor's registry mutex
+    std::vector<int> subscribed_events;
+    std::vector<int> subscribed_timers;
+    std::map<int, lua_task> tasks;
+    int next_task_id = 0;
+    std::vector<int> runnable_tasks; // guarded by queue_mutex
+    std::vector<int> awaiting_tasks; // guarded by queue_mutex
+    uint64_t seen_change_epoch = 0;  // executor::notify_change() calls the awaiting tasks have seen
+    lua_task *running_task = nullptr;
+    script_metrics metrics;
+    int hook_count;                       // base interval of the instruction count hook
+    script_budget budget;
+    phase_t phase = IDLE;
+    std::chrono::nanoseconds phase_begin;   // thread cpu time at the first count hook of the phase, 0 before it
+    std::chrono::nanoseconds phase_budget;
+    std::chrono::nanoseconds last_hook;     // thread cpu time of the last count hook in this phase
+    bool phase_overrun = false;
+    std::atomic<bool> tick_overrun = false; // a phase ran over its soft budget since the last tick
+    std::chrono::steady_clock::time_point throttled_until;
+    unsigned overrunning_ticks = 0;         // consecutive ticks (throttled ones aside) with an overrun
+    std::unique_ptr<lua_profile> profile; // samples of the last profiling run
+    bool profiling = false;
+
+    // the running phase as seen by the watchdog thread
+    struct phase_watch {
+      std::atomic<uint64_t> phase_seq = 0;   // odd while a phase runs
+      std::atomic<int64_t> wall_begin_ns = 0;
+      std::atomic<clockid_t> cpu_clock = CLOCK_THREAD_CPUTIME_ID; // of the thread running the phase
+      std::atomic<int64_t> budget_ns = 0;
+      std::atomic<int64_t> hard_limit_ns = 0;
+      std::atomic<uint64_t> overrun_seq = 0; // last phase reported as overrun
+      std::atomic<uint64_t> preempt_seq = 0; // last phase preempted
+      // watchdog thread only: cpu time of the running thread when the watchdog first saw phase cpu_begin_seq
+      uint64_t cpu_begin_seq = 0;
+      int64_t cpu_begin_ns = 0;
+    } watch;
+    watchdog *watched_by = nullptr;
+    std::mutex threads_mutex;               // guards running_threads, the watchdog preempts them
+    std::vector<lua_State *> running_threads; // coroutines resumed in the running phase, innermost last
   };
 
   class executor {
@@ -123,18 +283,149 @@ namespace lua_vm {
     executor(std::function<void(lua_State *)> bind_lua_script_to_dataplane);
 
   public:
+    // f binds the dataplane to the state of each new script. With set_worker_threads() load_scripts() calls it
+    // concurrently for different scripts, so it must be thread safe then.
     static std::unique_ptr<executor> make_unique(std::function<void(lua_State *)> f=nullptr) {
       return std::unique_ptr<executor>(new executor(f));
     }
 
+    ~executor();
+
+    // Loads the .lua files of script_dir in the order of their names, then calls their init() in that order. With
+    // set_worker_threads() called before, the files are compiled, bound and their top level runs on the worker
+    // threads concurrently. Then only the execution order and the order of the init() calls are deterministic: ids
+    // of events and timers opened by the top levels and the order of subscribers of an event depend on timing.
+    // Open and subscribe in init() where that matters.
     void load_scripts(std::string script_dir);
     bool loadScriptFromFile(const std::string& script_path);
-    bool loadScriptFromBuffer(const std::string& script_buffer);
+    bool loadScriptFromBuffer(const std::string& script_buffer, const std::string &name = "buffer");
 
     void run_loop();
 
+    // Calls run_loop() until stop(). Between ticks the thread sleeps until the next timer or periodic event is due,
+    // wake() is called or an event is pending. Scripts still get their loop() called at least every max_interval,
+    // 0 means loop() only runs when something happened.
+    void run_forever(std::chrono::milliseconds max_interval = std::chrono::milliseconds(100));
+
+    // As run_forever() but also returns at deadline
+    void run_until(std::chrono::steady_clock::time_point deadline,
+                   std::chrono::milliseconds max_interval = std::chrono::milliseconds(100));
+
+    // thread safe, makes run_forever()/run_until() return after the current tick
+    void stop();
+
+    // thread safe, makes a sleeping run_forever()/run_until() run the next tick now
+    void wake();
+
+    // id of event_name, the event is created if it does not exist. An empty name always creates a new event. Thread
+    // safe.
+    int event_open(std::string_view event_name);
+
+    // Thread safe publish for other threads, e.g. dataplane workers, CAN readers or a UI. Lock free unless it has to
+    // wake a sleeping run_forever()/run_until(): the event goes to an inbox that the next tick drains before timers
+    // and scripts run. The payload, if any, is passed to each handler as its second argument.
+    void post_event(int eventid, event_payload_ptr payload = nullptr);
+
+    // Thread safe, for dataplanes: data that await() conditions may read has changed. Awaiting tasks check their
+    // condition again in the next tick, which runs now if run_forever()/run_until() sleeps. Events and timers
+    // delivered to a script wake its awaiting tasks anyway. Optional: without it awaiting tasks notice a change
+    // after 100 ms at the latest.
+    void notify_change();
+
+    // earliest deadline of all timers and periodic events, time_point::max() if there is none
+    std::chrono::steady_clock::time_point next_deadline();
+
+    // Run scripts on nr_of_threads threads (the caller of run_loop() included), 1 means serial execution. Also used
+    // by load_scripts().
+    // Each script still runs on one thread at a time, but the dataplane bound to the scripts and the bind callback
+    // given to make_unique() must be thread safe.
+    void set_worker_threads(size_t nr_of_threads);
+
+    inline size_t get_worker_threads() const {
+      return pool_ ? pool_->nr_of_participants() : 1;
+    }
+
     int64_t get_total_ops() const;
 
+    // Creates n states with libraries and executor bindings loaded, new scripts take them instead of building
+    // their own. Thread safe, can run in the background while scripts are loaded.
+    void prewarm_states(size_t n);
+
+    // Persist compiled scripts in dir, so a restart with unchanged scripts skips compilation. By default compiled
+    // chunks are only cached in memory. Safe while hot reload is enabled, a reload in progress finishes with the
+    // previous cache.
+    void set_chunk_cache_dir(const std::string &dir);
+
+    inline const chunk_cache &get_chunk_cache() const {
+      return *chunk_cache_;
+    }
+
+    // Hard limit on the Lua heap of each script loaded after the call, 0 is unlimited. A script that hits it gets
+    // a memory error and is removed like on any other runtime error.
+    inline void set_script_memory_quota(size_t bytes) {
+      script_memory_quota_ = bytes;
+    }
+
+    // allocator statistics of the loaded scripts, in execution order
+    std::vector<script_allocator::stats> get_memory_stats() const;
+
+    // metrics of the loaded scripts, in execution order. Call it from the thread running the executor (scripts may
+    // be removed by run_loop()) or use set_metrics_dump().
+    std::vector<script_metrics::report> get_script_metrics() const;
+
+    // Final metrics of the scripts removed for a runtime error, a timeout or running over their budget, oldest first.
+    // Only the last max_removed_scripts are kept. Call it from the thread running the executor.
+    inline const std::deque<script_metrics::report> &get_removed_script_metrics() const {
+      return removed_scripts_;
+    }
+
+    static constexpr size_t max_removed_scripts = 64;
+
+    typedef std::function<void(const std::vector<script_metrics::report> &)> metrics_sink;
+
+    // Samples the Lua stacks of all scripts every sample_every_instructions instructions, also of scripts loaded
+    // later. Restarting drops the earlier samples. Call it from the thread running the executor.
+    void start_profiling(int sample_every_instructions = 10000);
+
+    // keeps the samples for write_profile()
+    void stop_profiling();
+
+    // folded stacks of all scripts (rooted at the script name) for flamegraph.pl, inferno or speedscope
+    void write_profile(std::ostream &os) const;
+
+    // Enforce budgets from a watchdog thread that checks the running scripts every period, instead of from the
+    // instruction count hook. Scripts then run without a hook (unless profiled) and are only interrupted when they
+    // run over; the instruction metric is not counted. Call it from the thread running the executor.
+    void enable_watchdog(std::chrono::microseconds period = std::chrono::milliseconds(1));
+
+    inline bool has_watchdog() const {
+      return watchdog_ != nullptr;
+    }
+
+    // Reloads the .lua files of script_dir when they change, without restarting the executor. A changed or added
+    // file is compiled on a watcher thread, then at the next tick boundary its top level and init() run and it
+    // replaces the script of the same name: events queued for the old version before the swap started are handed
+    // over (not those its successor published itself while starting up, so none arrives twice) and the old version
+    // is removed. Other scripts keep running untouched. If the new version fails to compile, to run or in
+    // init() the old one keeps running. A removed file removes its script. Call it from the thread running the
+    // executor, typically after load_scripts(script_dir).
+    void enable_hot_reload(const std::string &script_dir);
+
+    // scripts swapped in or removed by hot reload so far
+    inline size_t get_nr_of_reloads() const {
+      return nr_of_reloads_;
+    }
+
+    // budget of scripts loaded after the call
+    void set_default_budget(const script_budget &budget);
+
+    // Budget of the script called name (its file name, or the name given to loadScriptFromBuffer()), for the loaded
+    // one and when it is loaded again. Call it from the thread running the executor.
+    void set_script_budget(const std::string &name, const script_budget &budget);
+
+    // Every interval run_loop() passes get_script_metrics() to sink, by default they are logged. 0 turns it off.
+    void set_metrics_dump(std::chrono::milliseconds interval, metrics_sink sink = nullptr);
+
     inline size_t get_nr_of_scripts() const {
       return scripts_.size();
     }
@@ -142,6 +433,12 @@ namespace lua_vm {
     static void lua_register_event_functions(lua_State *L);
     static void lua_load_libraries(lua_State *L);
 
+    // state with its own script_allocator and libraries and event functions loaded, ready to be bound to a script
+    static lua_State *new_lua_state();
+
+    // closes a state from new_lua_state() that is not owned by a script
+    static void close_lua_state(lua_State *L);
+
   private:
     // language bindings
     static int _lua_log(lua_State *L);
@@ -174,41 +471,168 @@ namespace lua_vm {
 
     static int _lua_timer_name(lua_State *L);
 
-    void event_publish(int eventid);
+    static int _lua_task_spawn(lua_State *L);
+
+    static int _lua_asleep(lua_State *L);
+
+    static int _lua_await(lua_State *L);
+
+    static int _lua_coroutine_resume(lua_State *L);
+
+    static int _lua_coroutine_wrap(lua_State *L);
+
+    void event_publish(int eventid, const event_payload_ptr &payload = nullptr);
 
-    int event_open(std::string event_name);
+    // queues eventid to all subscribers, registry_mutex_ must be held
+    void event_deliver(int eventid, const event_payload_ptr &payload = nullptr);
 
-    int event_create_periodic(std::string event_name, std::chrono::milliseconds duration);
+    int event_create_periodic(std::string_view event_name, std::chrono::milliseconds duration);
+
+    // id of a named event, created if needed, registry_mutex_ must be held
+    int event_find_or_add(std::string_view event_name);
+
+    std::optional<std::string> event_name(lua_Integer eventid);
 
     void add_event_subscription(int eventid, lua_script *script);
 
+    // Subscribes the script of L to eventid with the function at fn_index, raises a Lua error on failure. A library
+    // handler is added, otherwise the script's own handler for the event is replaced.
+    static void event_subscribe(lua_State *L, lua_Integer eventid, int fn_index,
+                                lua_script::event_handler::mode_t mode, bool library);
+
     void remove_event_unsubscription(int eventid, lua_script *script);
 
     void unsubscribe_all(lua_script *script);
 
-    int timer_find_or_create_sharable(std::string name);
+    // removes a failed script from the execution list, keeping its final metrics
+    std::vector<std::unique_ptr<lua_script>>::iterator remove_failed_script(
+        std::vector<std::unique_ptr<lua_script>>::iterator it);
+
+    int timer_find_or_create_sharable(std::string_view name);
 
     int timer_create_private();
 
     void add_timer_subscription(int timer_id, lua_script *script);
 
     void timer_unsubscribe(int timer_id, lua_script *script);
+
+    // queues the current deadline of timers_[timer_id], registry_mutex_ must be held
+    void timer_schedule(int timer_id);
+
+    // parks a sleeping task until task.wake_at, or queues the fallback re-check of an awaiting one
+    void task_park(lua_script *script, int task_id, const lua_task &task);
+
+    // parks an awaiting task until something changed, for 100 ms at the latest
+    void await_park(lua_script *script, int task_id, lua_task &task);
+
+    // resumes the runnable tasks of a script, false on error with the message on the script's stack
+    bool run_tasks(lua_script *script);
     //void timer_signal(int timer_id);
 
+    // calls f(timer&) with the registry locked, returns false if the timer does not exist
+    template<typename F>
+    bool with_timer(lua_Integer timer_id, F &&f) {
+      std::lock_guard<std::mutex> lock(registry_mutex_);
+      if (timer_id < 0 || timer_id >= (lua_Integer) timers_.size())
+        return false;
+      auto &t = timers_[timer_id];
+      auto generation = t.generation();
+      f(t);
+      if (t.generation() != generation && t.is_running())
+        timer_schedule(static_cast<int>(timer_id));
+      return true;
+    }
+
   private:
+    // delivers the events of post_event() to the subscribers
+    void drain_inbox();
+    // on the script watcher's thread: compiles a changed script into the chunk cache and queues it for apply_reloads()
+    void prepare_reload(const std::string &path, script_watcher::change_t change);
+    // swaps in the scripts queued by prepare_reload(), at a tick boundary
+    void apply_reloads();
+    // loads path as the new version of the script name, nullptr if it fails
+    std::unique_ptr<lua_script> reload_script(const std::string &name, const std::string &path);
+    // drops a chunk no script needs anymore from the cache, thread safe
+    void evict_chunk(uint64_t key);
+
+    // drops the chunk of a removed script from memory unless another loaded script was made from it
+    void release_chunk(uint64_t key);
     void check_event_timers();
     void check_timers();
+    void check_tasks();
+    bool execute_script(lua_script *script);
+    void dump_metrics_if_due();
 
+    // script on a prewarmed state (if any) bound to the dataplane
+    std::unique_ptr<lua_script> create_script(const std::string &name);
+
+    // guards the event and timer registries below, scripts on other worker threads use them concurrently
+    std::mutex registry_mutex_;
     std::vector<std::string> eventnames_;
+    string_map<int> event_index_;  // named events in eventnames_
     std::map<int, std::unique_ptr<timer>> periodic_event_timers_;
-    std::map<int, std::set<lua_script *>> event_subscribers_;
+    std::vector<std::vector<lua_script *>> event_subscribers_; // by event id, in subscription order
     std::vector<timer> timers_;
-    std::map<int, std::set<lua_script *>> timer_subscribers_;
+    string_map<int> timer_index_;  // sharable (named) timers in timers_
+    std::vector<std::vector<lua_script *>> timer_subscribers_; // by timer id, in subscription order
+    // deadlines of running timers_ and periodic_event_timers_, so a tick only touches what is due
+    deadline_queue<int> timer_queue_;
+    deadline_queue<int> event_timer_queue_;
+    std::vector<deadline_queue<int>::entry> due_;
+
+    struct task_key {
+      lua_script *script;
+      int task_id;
+    };
+    deadline_queue<task_key> task_queue_; // sleeping tasks and re-checks of awaiting ones
+    std::vector<deadline_queue<task_key>::entry> due_tasks_;
+    std::atomic<bool> work_pending_ = false; // events or runnable tasks that are not yet handled
+    std::atomic<uint64_t> change_epoch_ = 0; // notify_change() calls
+
+    struct posted_event {
+      int id = -1;
+      event_payload_ptr payload;
+    };
+    mpsc_queue<posted_event> inbox_; // post_event() from any thread, drained by run_loop()
 
+    std::mutex wait_mutex_;
+    std::condition_variable wait_cv_;
+    bool wake_pending_ = false;
+    std::atomic<bool> sleeping_ = false; // run_forever()/run_until() waits, post_event() has to wake it
+    std::atomic<bool> stop_requested_ = false;
+
+    std::unique_ptr<watchdog> watchdog_; // outlives the scripts it watches
     std::vector<std::unique_ptr<lua_script>> scripts_;
     std::function<void(lua_State *)> bind_lua_script_to_dataplane_;
-    int64_t total_ops_ = 0;
+    std::unique_ptr<worker_pool> pool_;
+    std::mutex chunk_cache_mutex_; // guards replacing chunk_cache_, the script watcher's thread reads it
+    std::shared_ptr<chunk_cache> chunk_cache_;
+    size_t script_memory_quota_ = 0;
+    std::mutex state_pool_mutex_;
+    std::vector<lua_State *> state_pool_;
+    std::vector<char> script_ok_;
+    std::atomic<int64_t> total_ops_ = 0;
+    std::chrono::milliseconds metrics_dump_interval_ = std::chrono::milliseconds(0);
+    std::chrono::steady_clock::time_point next_metrics_dump_;
+    metrics_sink metrics_sink_;
+    std::deque<script_metrics::report> removed_scripts_;
+    int profile_instruction_count_ = 0; // 0 when not profiling
+    script_budget default_budget_;
+    std::map<std::string, script_budget> script_budgets_;
+
+    struct pending_reload {
+      std::string name;
+      std::string path;
+      script_watcher::change_t change;
+      uint64_t chunk_key = 0; // of the compiled new version in the chunk cache
+    };
+    std::mutex reload_mutex_;
+    std::vector<pending_reload> pending_reloads_; // guarded by reload_mutex_
+    std::atomic<bool> reloads_pending_ = false;
+    size_t nr_of_reloads_ = 0;
+    std::unique_ptr<script_watcher> script_watcher_; // stopped first in ~executor()
 
     friend class ExecutorTest;
+    friend void lua_event_subscribe(lua_State *L, int eventid, int fn_index);
   };
 } // namespace lua_vm
\ No newline at end of file
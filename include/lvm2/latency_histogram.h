@@ -0,0 +1,103 @@
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <bit>
+#include <chrono>
+#include <cstdint>
+#pragma once
+
+namespace lua_vm {
+  /*
+   * HDR style histogram of durations in nanoseconds: values are bucketed by power of two with 16 linear sub buckets
+   * each, so any percentile is reported within 1/16 (6.25%) of the recorded value. Fixed size, recording is a few
+   * shifts and two relaxed stores.
+   *
+   * Single writer: record() and reset() must not run concurrently with each other, readers on other threads may
+   * query at any time and see a slightly stale but never torn result.
+   */
+  class latency_histogram {
+  public:
+    struct summary {
+      uint64_t count;
+      std::chrono::nanoseconds p50;
+      std::chrono::nanoseconds p99;
+      std::chrono::nanoseconds max;
+    };
+
+    inline void record(std::chrono::nanoseconds duration) {
+      uint64_t v = duration.count() > 0 ? static_cast<uint64_t>(duration.count()) : 0;
+      if (v > max_trackable)
+        v = max_trackable;
+      bump(buckets_[index_of(v)]);
+      bump(count_);
+      if (v > max_.load(std::memory_order_relaxed))
+        max_.store(v, std::memory_order_relaxed);
+    }
+
+    inline uint64_t count() const {
+      return count_.load(std::memory_order_relaxed);
+    }
+
+    inline std::chrono::nanoseconds max() const {
+      return std::chrono::nanoseconds(max_.load(std::memory_order_relaxed));
+    }
+
+    // upper bound of the bucket holding the p'th percentile (0 < p <= 100), 0 if nothing was recorded
+    std::chrono::nanoseconds percentile(double p) const {
+      uint64_t total = count();
+      if (total == 0)
+        return std::chrono::nanoseconds(0);
+      uint64_t rank = static_cast<uint64_t>(p / 100.0 * static_cast<double>(total) + 0.5);
+      if (rank == 0)
+        rank = 1;
+      uint64_t seen = 0;
+      for (size_t i = 0; i != nr_of_buckets; ++i) {
+        seen += buckets_[i].load(std::memory_order_relaxed);
+        if (seen >= rank)
+          return std::chrono::nanoseconds(std::min(highest_of(i), max_.load(std::memory_order_relaxed)));
+      }
+      return max();
+    }
+
+    inline summary summarize() const {
+      return summary{count(), percentile(50), percentile(99), max()};
+    }
+
+    void reset() {
+      for (auto &b: buckets_)
+        b.store(0, std::memory_order_relaxed);
+      count_.store(0, std::memory_order_relaxed);
+      max_.store(0, std::memory_order_relaxed);
+    }
+
+  private:
+    static constexpr unsigned sub_bucket_bits = 4;
+    static constexpr uint64_t sub_buckets = uint64_t(1) << sub_bucket_bits;
+    static constexpr uint64_t max_trackable = (uint64_t(1) << 40) - 1; // ~18 minutes
+    static constexpr size_t nr_of_buckets = (40 - sub_bucket_bits) * sub_buckets + 2 * sub_buckets;
+
+    // values below 2 * sub_buckets are exact, above that the top sub_bucket_bits + 1 bits select the bucket
+    static inline size_t index_of(uint64_t v) {
+      if (v < 2 * sub_buckets)
+        return static_cast<size_t>(v);
+      unsigned shift = static_cast<unsigned>(std::bit_width(v)) - (sub_bucket_bits + 1);
+      return static_cast<size_t>(shift * sub_buckets + (v >> shift));
+    }
+
+    static inline uint64_t highest_of(size_t i) {
+      if (i < 2 * sub_buckets)
+        return i;
+      uint64_t shift = i / sub_buckets - 1;
+      uint64_t m = sub_buckets + i % sub_buckets;
+      return ((m + 1) << shift) - 1;
+    }
+
+    static inline void bump(std::atomic<uint64_t> &counter) {
+      counter.store(counter.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    }
+
+    std::array<std::atomic<uint64_t>, nr_of_buckets> buckets_{};
+    std::atomic<uint64_t> count_ = 0;
+    std::atomic<uint64_t> max_ = 0;
+  };
+} // namespace lua_vm
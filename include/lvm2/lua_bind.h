@@ -0,0 +1,150 @@
+#include <cstdint>
+#include <cstring>
+#include <exception>
+#include <lua.hpp>
+#include <string>
+#include <string_view>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include "lua_binding.h"
+#pragma once
+
+namespace lua_vm {
+  // a signal addressed from Lua by handle (an integer) or by name (a string)
+  struct handle_or_name {
+    lua_Integer handle = -1;
+    std::string_view name; // empty data() if addressed by handle
+
+    inline bool is_handle() const {
+      return name.data() == nullptr;
+    }
+  };
+
+  /*
+   * Lua trampolines for member functions of a library object, generated from their signature:
+   *
+   *   luaL_Reg funcs[] = {
+   *       lua_vm::bind<&dataplane::get>("get"),
+   *       lua_vm::bind<&dataplane::set>("set"),
+   *       {NULL, NULL}
+   *   };
+   *   lua_vm::register_library(L, "db", funcs, db);
+   *
+   * Argument i of the function is taken from stack index i: integers, floating point, bool, std::string_view,
+   * const char * and handle_or_name; strings are not copied. Results of these types (and std::string) are pushed,
+   * void pushes nothing. A method int (lua_State *) is called as is, for values whose type is only known at run
+   * time. An exception becomes a Lua error "exception '<what>'" raised after the C++ frames are left. Overloaded
+   * functions have to be named by a cast or get a distinct name.
+   */
+  namespace bind_detail {
+    template<typename T>
+    inline constexpr bool unsupported = false;
+
+    template<typename T>
+    inline T check_arg(lua_State *L, int idx) {
+      using U = std::remove_cv_t<std::remove_reference_t<T>>;
+      if constexpr (std::is_same_v<U, bool>) {
+        return lua_toboolean(L, idx) != 0;
+      } else if constexpr (std::is_integral_v<U>) {
+        return static_cast<U>(luaL_checkinteger(L, idx));
+      } else if constexpr (std::is_floating_point_v<U>) {
+        return static_cast<U>(luaL_checknumber(L, idx));
+      } else if constexpr (std::is_same_v<U, std::string_view>) {
+        size_t len = 0;
+        const char *s = luaL_checklstring(L, idx, &len);
+        return std::string_view(s, len);
+      } else if constexpr (std::is_same_v<U, const char *>) {
+        return luaL_checkstring(L, idx);
+      } else if constexpr (std::is_same_v<U, handle_or_name>) {
+        if (lua_isinteger(L, idx))
+          return handle_or_name{lua_tointeger(L, idx), {}};
+        size_t len = 0;
+        const char *s = luaL_checklstring(L, idx, &len);
+        return handle_or_name{-1, std::string_view(s, len)};
+      } else {
+        static_assert(unsupported<U>,
+                      "no Lua conversion for this argument type, strings are taken as std::string_view");
+      }
+    }
+
+    template<typename T>
+    inline void push_result(lua_State *L, const T &value) {
+      using U = std::remove_cv_t<std::remove_reference_t<T>>;
+      if constexpr (std::is_same_v<U, bool>) {
+        lua_pushboolean(L, value);
+      } else if constexpr (std::is_integral_v<U>) {
+        lua_pushinteger(L, static_cast<lua_Integer>(value));
+      } else if constexpr (std::is_floating_point_v<U>) {
+        lua_pushnumber(L, static_cast<lua_Number>(value));
+      } else if constexpr (std::is_same_v<U, std::string_view> || std::is_same_v<U, std::string>) {
+        lua_pushlstring(L, value.data(), value.size());
+      } else if constexpr (std::is_same_v<U, const char *>) {
+        lua_pushstring(L, value);
+      } else {
+        static_assert(unsupported<U>, "no Lua conversion for this result type");
+      }
+    }
+
+    template<typename M>
+    struct method_traits;
+
+    template<typename C, typename R, typename... A>
+    struct method_traits<R (C::*)(A...)> {
+      typedef C object_type;
+      typedef R result_type;
+      typedef std::tuple<A...> args_type;
+    };
+
+    template<typename C, typename R, typename... A>
+    struct method_traits<R (C::*)(A...) const> : method_traits<R (C::*)(A...)> {
+    };
+
+    template<typename C, typename R, typename... A>
+    struct method_traits<R (C::*)(A...) noexcept> : method_traits<R (C::*)(A...)> {
+    };
+
+    template<typename C, typename R, typename... A>
+    struct method_traits<R (C::*)(A...) const noexcept> : method_traits<R (C::*)(A...)> {
+    };
+
+    template<auto Method, size_t... I>
+    inline int call(lua_State *L, std::index_sequence<I...>) {
+      typedef method_traits<decltype(Method)> traits;
+      typedef typename traits::args_type args;
+      auto object = bound_object<typename traits::object_type>(L);
+      // arguments are trivially destructible, a Lua error raised while checking them skips no destructor
+      if constexpr (std::is_same_v<args, std::tuple<lua_State *>>) {
+        static_assert(std::is_same_v<typename traits::result_type, int>, "raw Lua functions return int");
+        return (object->*Method)(L);
+      } else if constexpr (std::is_void_v<typename traits::result_type>) {
+        (object->*Method)(check_arg<std::tuple_element_t<I, args>>(L, static_cast<int>(I) + 1)...);
+        return 0;
+      } else {
+        push_result(L, (object->*Method)(check_arg<std::tuple_element_t<I, args>>(L, static_cast<int>(I) + 1)...));
+        return 1;
+      }
+    }
+
+    template<auto Method>
+    int trampoline(lua_State *L) {
+      char what[256];
+      try {
+        typedef typename method_traits<decltype(Method)>::args_type args;
+        return call<Method>(L, std::make_index_sequence<std::tuple_size_v<args>>());
+      }
+      catch (std::exception &e) {
+        std::strncpy(what, e.what(), sizeof(what) - 1);
+        what[sizeof(what) - 1] = '\0';
+      }
+      // outside the handler, luaL_error does not return
+      return luaL_error(L, "exception '%s'", what);
+    }
+  } // namespace bind_detail
+
+  // entry of a luaL_Reg table for register_library(), the library object is the one of the method's class
+  template<auto Method>
+  constexpr luaL_Reg bind(const char *name) {
+    return luaL_Reg{name, &bind_detail::trampoline<Method>};
+  }
+} // namespace lua_vm
@@ -0,0 +1,51 @@
+#include <lua.hpp>
+#include <string_view>
+#pragma once
+
+namespace lua_vm {
+  /*
+   * Helpers for C bindings to find their C++ objects without looking up globals on every call, and without globals
+   * that scripts could overwrite.
+   *
+   * - Per state objects (the executor's lua_script) live in the state's extra space, which coroutines copy from the
+   *   main thread when they are created.
+   * - Library objects (a dataplane) are passed as upvalue 1 of each function registered with register_library().
+   */
+  static_assert(LUA_EXTRASPACE >= sizeof(void *), "the extra space of a lua_State must hold a pointer");
+
+  // sets the object of L and of coroutines created from L afterwards
+  template<typename T>
+  inline void set_state_object(lua_State *L, T *object) {
+    *static_cast<T **>(lua_getextraspace(L)) = object;
+  }
+
+  template<typename T>
+  inline T *state_object(lua_State *L) {
+    return *static_cast<T **>(lua_getextraspace(L));
+  }
+
+  // Creates the global table name with funcs, each function gets object as upvalue 1 for bound_object()
+  template<typename T>
+  void register_library(lua_State *L, const char *name, const luaL_Reg *funcs, T *object) {
+    int n = 0;
+    while (funcs[n].name)
+      ++n;
+    lua_createtable(L, 0, n);
+    lua_pushlightuserdata(L, object);
+    luaL_setfuncs(L, funcs, 1);
+    lua_setglobal(L, name);
+  }
+
+  // object of a function registered with register_library(), only valid in that function
+  template<typename T>
+  inline T *bound_object(lua_State *L) {
+    return static_cast<T *>(lua_touserdata(L, lua_upvalueindex(1)));
+  }
+
+  // For libraries called by a script of an executor: event.open(name) and event.subscribe(eventid, fn at fn_index)
+  // of the calling script, reached through the extra space rather than the event global, which the script could
+  // reassign. Raise a Lua error if L does not belong to a script. Defined by the executor.
+  int lua_event_open(lua_State *L, std::string_view name);
+
+  void lua_event_subscribe(lua_State *L, int eventid, int fn_index);
+} // namespace lua_vm
@@ -0,0 +1,37 @@
+#include <cstdint>
+#include <lua.hpp>
+#include <map>
+#include <mutex>
+#include <ostream>
+#include <string>
+#pragma once
+
+namespace lua_vm {
+  /*
+   * Samples of the Lua call stacks of one script, taken from the instruction count hook so hot code gets sampled in
+   * proportion to the instructions it runs. Uses lua_getstack/lua_getinfo only, the debug library is not needed in
+   * the script's state.
+   *
+   * Stacks are aggregated as they are sampled and written in the folded format of flamegraph.pl/inferno/speedscope:
+   * "root;caller;callee count" per line.
+   */
+  class lua_profile {
+  public:
+    // records the stack of the running thread (or coroutine) L
+    void sample(lua_State *L);
+
+    // writes one folded line per distinct stack with prefix as the root frame, e.g. the script name
+    void write_folded(std::ostream &os, const std::string &prefix) const;
+
+    uint64_t nr_of_samples() const;
+
+    void clear();
+
+  private:
+    static constexpr int max_depth = 64;
+
+    mutable std::mutex mutex_; // samples are taken on the script's thread, reports come from anywhere
+    std::map<std::string, uint64_t> stacks_;
+    uint64_t samples_ = 0;
+  };
+} // namespace lua_vm
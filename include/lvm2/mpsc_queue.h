@@ -0,0 +1,63 @@
+#include <atomic>
+#include <utility>
+#pragma once
+
+namespace lua_vm {
+  /*
+   * Unbounded multi producer single consumer queue (Vyukov's node based queue). push() is one atomic exchange and
+   * never waits for other producers or the consumer; pop() and empty() must only be called by the one consumer
+   * thread.
+   *
+   * An element whose push() is still in progress can hide the elements pushed after it until the push completes,
+   * so the consumer may briefly see fewer elements than were pushed - never a torn or reordered one.
+   */
+  template<typename T>
+  class mpsc_queue {
+  public:
+    mpsc_queue() : head_(new node), tail_(head_.load(std::memory_order_relaxed)) {
+    }
+
+    ~mpsc_queue() {
+      T value;
+      while (pop(value)) {
+      }
+      delete tail_;
+    }
+
+    mpsc_queue(const mpsc_queue &) = delete;
+
+    mpsc_queue &operator=(const mpsc_queue &) = delete;
+
+    void push(T value) {
+      node *n = new node;
+      n->value = std::move(value);
+      node *prev = head_.exchange(n, std::memory_order_acq_rel);
+      prev->next.store(n, std::memory_order_release);
+    }
+
+    // consumer only, false if the queue is empty
+    bool pop(T &value) {
+      node *next = tail_->next.load(std::memory_order_acquire);
+      if (next == nullptr)
+        return false;
+      value = std::move(next->value);
+      delete tail_;
+      tail_ = next; // next is the new stub, its value is moved out
+      return true;
+    }
+
+    // consumer only
+    inline bool empty() const {
+      return tail_->next.load(std::memory_order_acquire) == nullptr;
+    }
+
+  private:
+    struct node {
+      std::atomic<node *> next = nullptr;
+      T value{};
+    };
+
+    std::atomic<node *> head_; // last pushed, producers swap themselves in here
+    node *tail_;               // stub before the oldest element, owned by the consumer
+  };
+} // namespace lua_vm
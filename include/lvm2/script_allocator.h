@@ -0,0 +1,82 @@
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+#pragma once
+
+namespace lua_vm {
+  /*
+   * lua_Alloc for a single lua_State. Small blocks come from per size class free lists carved out of 64k arenas,
+   * larger ones from malloc. With a quota an allocation that would exceed it fails and Lua raises a memory error
+   * in the script.
+   *
+   * Only the owning state allocates, but the counters may be read from any thread.
+   */
+  class script_allocator {
+  public:
+    struct stats {
+      size_t bytes_in_use;
+      size_t peak_bytes;
+      uint64_t allocations;
+      uint64_t failed_allocations;
+      size_t quota;
+    };
+
+    explicit script_allocator(size_t quota = 0);
+
+    ~script_allocator();
+
+    script_allocator(const script_allocator &) = delete;
+
+    script_allocator &operator=(const script_allocator &) = delete;
+
+    // the lua_Alloc, ud is the script_allocator
+    static void *lua_alloc(void *ud, void *ptr, size_t osize, size_t nsize);
+
+    // 0 means unlimited
+    inline void set_quota(size_t bytes) {
+      quota_ = bytes;
+    }
+
+    inline size_t quota() const {
+      return quota_;
+    }
+
+    inline size_t bytes_in_use() const {
+      return bytes_in_use_.load(std::memory_order_relaxed);
+    }
+
+    stats get_stats() const;
+
+  private:
+    static constexpr size_t granularity = 16;
+    static constexpr size_t max_small_size = 512;
+    static constexpr size_t nr_of_classes = max_small_size / granularity;
+    static constexpr size_t arena_size = 64 * 1024;
+
+    struct free_block {
+      free_block *next;
+    };
+
+    static inline size_t class_of(size_t size) {
+      return (size + granularity - 1) / granularity - 1;
+    }
+
+    void *allocate(size_t size);
+
+    void deallocate(void *ptr, size_t size);
+
+    void *reallocate(void *ptr, size_t osize, size_t nsize);
+
+    free_block *free_lists_[nr_of_classes] = {};
+    std::vector<void *> arenas_;
+    char *bump_ = nullptr;
+    char *bump_end_ = nullptr;
+
+    std::atomic<size_t> quota_;
+    std::atomic<size_t> bytes_in_use_ = 0;
+    std::atomic<size_t> peak_bytes_ = 0;
+    std::atomic<uint64_t> allocations_ = 0;
+    std::atomic<uint64_t> failed_allocations_ = 0;
+  };
+} // namespace lua_vm
@@ -0,0 +1,39 @@
+#include <chrono>
+#include <time.h>
+#pragma once
+
+namespace lua_vm {
+  /*
+   * CPU time a script may spend in one go, per phase. Time is the CPU time of the executing thread, so scripts on a
+   * busy worker pool are not blamed for time they spent descheduled.
+   *
+   * The instruction count hook checks the budget; its interval adapts to the speed of the script so an overrun is
+   * detected within tolerance. A phase is timed from its first hook, so the many phases ending before it (most
+   * callbacks) never read the clock; the time up to that hook, about one tolerance, is not counted.
+   */
+  struct script_budget {
+    enum mode_t {
+      HARD, // an overrun is a runtime error, the script is evicted
+      SOFT  // an overrun is counted in the script metrics and throttles the script
+    };
+
+    std::chrono::microseconds init = std::chrono::seconds(1);            // top level chunk and init()
+    std::chrono::microseconds loop = std::chrono::milliseconds(10);      // loop()
+    std::chrono::microseconds callback = std::chrono::milliseconds(10);  // each event/timer handler or task resume
+    std::chrono::microseconds tolerance = std::chrono::milliseconds(1);
+    mode_t mode = HARD;
+
+    // SOFT: after an overrun the script skips its ticks for this long
+    std::chrono::milliseconds throttle = std::chrono::milliseconds(100);
+    // SOFT: evicted after overrunning in this many ticks in a row (throttled ticks do not count), 0 is never
+    unsigned evict_after = 10;
+    // SOFT: a phase running longer than budget * hard_limit_factor is still interrupted, as in HARD
+    unsigned hard_limit_factor = 10;
+  };
+
+  inline std::chrono::nanoseconds thread_cpu_time() {
+    timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return std::chrono::seconds(ts.tv_sec) + std::chrono::nanoseconds(ts.tv_nsec);
+  }
+} // namespace lua_vm
@@ -0,0 +1,50 @@
+#include <atomic>
+#include <cstdint>
+#include <ostream>
+#include <string>
+#include "latency_histogram.h"
+#pragma once
+
+namespace lua_vm {
+  /*
+   * Runtime metrics of one script. Written by the thread currently running the script, readable from any thread.
+   */
+  struct script_metrics {
+    latency_histogram loop_latency;
+    latency_histogram callback_latency;          // event and timer handlers and task resumes
+    std::atomic<uint64_t> events_dispatched = 0;
+    std::atomic<uint64_t> timers_dispatched = 0;
+    std::atomic<uint64_t> tasks_resumed = 0;
+    std::atomic<uint64_t> errors = 0;
+    std::atomic<uint64_t> budget_overruns = 0;   // phases that ran over a soft budget
+    std::atomic<uint64_t> timeouts = 0;          // phases interrupted for running over budget
+    std::atomic<uint64_t> throttled_ticks = 0;
+    std::atomic<uint64_t> instructions = 0;      // in steps of the instruction count hook
+    std::atomic<size_t> heap_bytes = 0;          // Lua heap after the last loop
+
+    // plain copy for reporting
+    struct report {
+      std::string name;
+      latency_histogram::summary loop_latency;
+      latency_histogram::summary callback_latency;
+      uint64_t events_dispatched;
+      uint64_t timers_dispatched;
+      uint64_t tasks_resumed;
+      uint64_t errors;
+      uint64_t budget_overruns;
+      uint64_t timeouts;
+      uint64_t throttled_ticks;
+      uint64_t instructions;
+      size_t heap_bytes;
+    };
+
+    report get_report(const std::string &name) const;
+
+    static inline void add(std::atomic<uint64_t> &counter, uint64_t n = 1) {
+      counter.store(counter.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+    }
+  };
+
+  // one line per script, latencies in microseconds
+  std::ostream &operator<<(std::ostream &os, const script_metrics::report &r);
+} // namespace lua_vm
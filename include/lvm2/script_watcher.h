@@ -0,0 +1,40 @@
+#include <functional>
+#include <string>
+#include <thread>
+#pragma once
+
+namespace lua_vm {
+  /*
+   * Reports the .lua files of a directory that were written, moved in or removed, using inotify (Linux). The
+   * callback runs on the watcher's own thread, once per change; a file written in several steps may be reported
+   * more than once, the last report reflects its final content.
+   */
+  class script_watcher {
+  public:
+    enum change_t {
+      CHANGED, // written or moved into the directory
+      REMOVED  // deleted or moved out of the directory
+    };
+
+    typedef std::function<void(const std::string &path, change_t change)> callback_fn;
+
+    // throws std::system_error if dir cannot be watched
+    script_watcher(const std::string &dir, callback_fn on_change);
+
+    // waits for a running callback to return
+    ~script_watcher();
+
+    script_watcher(const script_watcher &) = delete;
+
+    script_watcher &operator=(const script_watcher &) = delete;
+
+  private:
+    void run();
+
+    std::string dir_;
+    callback_fn on_change_;
+    int inotify_fd_ = -1;
+    int stop_fd_ = -1; // eventfd, readable when the watcher stops
+    std::thread thread_;
+  };
+} // namespace lua_vm
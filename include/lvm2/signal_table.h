@@ -0,0 +1,261 @@
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <lua.hpp>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <unordered_map>
+#include <vector>
+#include "lua_binding.h"
+#include "string_hash.h"
+#pragma once
+
+namespace lua_vm {
+  /*
+   * Storage for a dataplane: signal names are interned once to dense handles and the values live in a contiguous
+   * array indexed by handle. Name lookups hash a string_view and never build a std::string, handle lookups are an
+   * array index.
+   *
+   * Writes go through a seqlock and stamp the signal with a version, so observer threads can take a consistent
+   * snapshot() or read only the changes_since() their last read without ever blocking the writers. Writers are
+   * serialized by the seqlock itself. Adding signals (intern(), set() by name of a new signal, reserve()) is not
+   * safe while observers read - register the catalog before they start.
+   *
+   * Scripts subscribe to changes with lua_subscribe(), which maps a signal to the executor event "signal:<name>".
+   * The dataplane posts event(h) when set() reports a change, so subscribers run on changes instead of polling.
+   */
+  template<typename Value = int64_t>
+  class signal_table {
+    static_assert(std::is_trivially_copyable_v<Value> && std::atomic<Value>::is_always_lock_free,
+                  "signal values must fit a lock free atomic");
+
+  public:
+    typedef uint32_t handle_t;
+    typedef Value value_type;
+
+    // handle of name, the signal is added with initial if it does not exist yet
+    handle_t intern(std::string_view name, Value initial = Value{}) {
+      auto it = index_.find(name);
+      if (it != index_.end())
+        return it->second;
+      handle_t h = static_cast<handle_t>(slots_.size());
+      names_.emplace_back(name);
+      slots_.emplace_back(initial);
+      index_.emplace(names_.back(), h);
+      return h;
+    }
+
+    // handle of an existing signal, throws std::out_of_range if there is none
+    handle_t handle(std::string_view name) const {
+      auto it = index_.find(name);
+      if (it == index_.end())
+        throw std::out_of_range("Element: " + std::string(name) + " not found in collection");
+      return it->second;
+    }
+
+    inline bool contains(std::string_view name) const {
+      return index_.find(name) != index_.end();
+    }
+
+    inline bool valid(lua_Integer h) const {
+      return h >= 0 && h < (lua_Integer) slots_.size();
+    }
+
+    // h as a handle, throws std::out_of_range if it is not one
+    handle_t checked(lua_Integer h) const {
+      if (!valid(h))
+        throw std::out_of_range("signal handle " + std::to_string(h) + " not found");
+      return static_cast<handle_t>(h);
+    }
+
+    inline Value get(handle_t h) const {
+      return slots_[h].value.load(std::memory_order_relaxed);
+    }
+
+    // true if the value changed
+    bool set(handle_t h, Value value) {
+      uint64_t s = write_begin();
+      Value old = slots_[h].value.exchange(value, std::memory_order_relaxed);
+      slots_[h].version.store(s + 2, std::memory_order_relaxed);
+      write_end(s);
+      return !(old == value);
+    }
+
+    inline Value get(std::string_view name) const {
+      return get(handle(name));
+    }
+
+    inline bool set(std::string_view name, Value value) {
+      return set(intern(name), value);
+    }
+
+    // executor event to post when signal h changes, -1 if no script subscribed to it
+    inline int event(handle_t h) const {
+      return slots_[h].event.load(std::memory_order_relaxed);
+    }
+
+    inline void set_event(handle_t h, int eventid) {
+      slots_[h].event.store(eventid, std::memory_order_relaxed);
+    }
+
+    // version of the last completed write, 0 before the first one
+    inline uint64_t version() const {
+      return seq_.load(std::memory_order_acquire) & ~uint64_t(1);
+    }
+
+    // Consistent copy of all values indexed by handle, returns the version it reflects
+    uint64_t snapshot(std::vector<Value> &values) const {
+      for (;;) {
+        uint64_t s1 = seq_.load(std::memory_order_acquire);
+        if (s1 & 1)
+          continue; // a write is in progress
+        values.resize(slots_.size());
+        for (size_t i = 0; i != slots_.size(); ++i)
+          values[i] = slots_[i].value.load(std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (seq_.load(std::memory_order_relaxed) == s1)
+          return s1;
+      }
+    }
+
+    // Calls fn(handle, value) for every signal written after version since, as of one consistent point in time.
+    // Returns the version to pass next time.
+    template<typename F>
+    uint64_t changes_since(uint64_t since, F &&fn) const {
+      thread_local std::vector<std::pair<handle_t, Value>> changes;
+      for (;;) {
+        uint64_t s1 = seq_.load(std::memory_order_acquire);
+        if (s1 & 1)
+          continue;
+        changes.clear();
+        for (size_t i = 0; i != slots_.size(); ++i) {
+          if (slots_[i].version.load(std::memory_order_relaxed) > since)
+            changes.emplace_back(static_cast<handle_t>(i), slots_[i].value.load(std::memory_order_relaxed));
+        }
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (seq_.load(std::memory_order_relaxed) == s1) {
+          for (auto &[h, value]: changes)
+            fn(h, value);
+          return s1;
+        }
+      }
+    }
+
+    inline const std::string &name(handle_t h) const {
+      return names_[h];
+    }
+
+    inline const std::vector<std::string> &names() const {
+      return names_;
+    }
+
+    inline size_t size() const {
+      return slots_.size();
+    }
+
+    inline void reserve(size_t n) {
+      names_.reserve(n);
+      slots_.reserve(n);
+      index_.reserve(n);
+    }
+
+    // Resolves argument arg of a Lua call - a handle from signal.handle() or a name - to a handle.
+    // Raises a Lua error if there is no such signal.
+    handle_t lua_check_handle(lua_State *L, int arg) const {
+      if (lua_isinteger(L, arg)) {
+        lua_Integer h = lua_tointeger(L, arg);
+        if (!valid(h))
+          luaL_error(L, "signal handle %d not found", (int) h);
+        return static_cast<handle_t>(h);
+      }
+      size_t len = 0;
+      const char *name = luaL_checklstring(L, arg, &len);
+      auto it = index_.find(std::string_view(name, len));
+      if (it == index_.end())
+        luaL_error(L, "exception 'Element: %s not found in collection'", name);
+      return it->second;
+    }
+
+    // Implements subscribe(signal, fn) for a dataplane library: fn(value) is called on the subscribing script after
+    // the signal changed. L must belong to a script of an executor. Returns 1 result, the event id.
+    // A table wrapping this one can pass its own event handler, it gets the upvalues (owner, handle, fn).
+    int lua_subscribe(lua_State *L, lua_CFunction handler = on_change, const void *owner = nullptr) {
+      handle_t h = lua_check_handle(L, 1);
+      luaL_checktype(L, 2, LUA_TFUNCTION);
+
+      int eventid = event(h);
+      if (eventid < 0) {
+        // built by Lua, a Lua error skips no C++ destructor
+        const char *event_name = lua_pushfstring(L, "signal:%s", names_[h].c_str());
+        size_t len = lua_rawlen(L, -1);
+        eventid = lua_event_open(L, std::string_view(event_name, len));
+        lua_pop(L, 1);
+        set_event(h, eventid); // racing subscribers open the same event
+      }
+
+      lua_pushlightuserdata(L, const_cast<void *>(owner ? owner : this));
+      lua_pushinteger(L, h);
+      lua_pushvalue(L, 2);
+      lua_pushcclosure(L, handler, 3);
+      lua_event_subscribe(L, eventid, -1);
+      lua_pop(L, 1);
+
+      lua_pushinteger(L, eventid);
+      return 1;
+    }
+
+  private:
+    // event handler installed by lua_subscribe(), calls the subscriber with the current value
+    static int on_change(lua_State *L) {
+      auto table = static_cast<const signal_table *>(lua_touserdata(L, lua_upvalueindex(1)));
+      auto h = static_cast<handle_t>(lua_tointeger(L, lua_upvalueindex(2)));
+      lua_pushvalue(L, lua_upvalueindex(3));
+      if constexpr (std::is_floating_point_v<Value>)
+        lua_pushnumber(L, table->get(h));
+      else
+        lua_pushinteger(L, static_cast<lua_Integer>(table->get(h)));
+      lua_call(L, 1, 0);
+      return 0;
+    }
+
+    struct slot {
+      std::atomic<Value> value;
+      std::atomic<uint64_t> version; // seqlock version of the last write
+      std::atomic<int> event;
+
+      explicit slot(Value v)
+          : value(v), version(0), event(-1) {
+      }
+
+      // only used when the vector grows, which observers must not race with anyway
+      slot(const slot &other)
+          : value(other.value.load(std::memory_order_relaxed)),
+            version(other.version.load(std::memory_order_relaxed)),
+            event(other.event.load(std::memory_order_relaxed)) {
+      }
+    };
+
+    // takes the seqlock (odd sequence), returns the even sequence it started from
+    inline uint64_t write_begin() {
+      uint64_t s = seq_.load(std::memory_order_relaxed);
+      for (;;) {
+        if (!(s & 1) && seq_.compare_exchange_weak(s, s + 1, std::memory_order_relaxed))
+          break;
+        s = seq_.load(std::memory_order_relaxed);
+      }
+      std::atomic_thread_fence(std::memory_order_release);
+      return s;
+    }
+
+    inline void write_end(uint64_t s) {
+      seq_.store(s + 2, std::memory_order_release);
+    }
+
+    string_map<handle_t> index_;
+    std::vector<std::string> names_;
+    std::vector<slot> slots_;
+    std::atomic<uint64_t> seq_ = 0;
+  };
+} // namespace lua_vm
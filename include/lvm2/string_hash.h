@@ -0,0 +1,19 @@
+#include <functional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#pragma once
+
+namespace lua_vm {
+  // transparent hash, lets unordered containers keyed by std::string be searched with a string_view or const char*
+  struct string_hash {
+    using is_transparent = void;
+
+    inline size_t operator()(std::string_view s) const {
+      return std::hash<std::string_view>{}(s);
+    }
+  };
+
+  template<typename Value>
+  using string_map = std::unordered_map<std::string, Value, string_hash, std::equal_to<>>;
+} // namespace lua_vm
@@ -0,0 +1,84 @@
+#include <atomic>
+#include <cstdint>
+#include <ostream>
+#include <string>
+#pragma once
+
+namespace lua_vm {
+  /*
+   * Opt-in span tracer for executor ticks, written as Chrome trace JSON (opens in Perfetto or chrome://tracing).
+   *
+   * Spans go to a ring buffer owned by the recording thread, so recording takes no lock; when a buffer is full the
+   * oldest spans are overwritten. The ring is allocated by the thread's first span and released once the thread has
+   * exited and its spans were written. Compiled in with LVM2_ENABLE_TRACING, and even then a span costs one relaxed load
+   * until start() is called.
+   */
+  class tracer {
+  public:
+    // spans kept per thread, the most recent ones win
+    static constexpr size_t spans_per_thread = 1 << 16;
+
+    // drops the spans of an earlier run and starts recording
+    static void start();
+
+    static void stop();
+
+    static inline bool enabled() {
+      return enabled_.load(std::memory_order_relaxed);
+    }
+
+    // Writes all recorded spans. Call it after stop(), spans recorded while writing may be missing.
+    static void write_chrome_json(std::ostream &os);
+
+    // false if path cannot be written
+    static bool write_chrome_json(const std::string &path);
+
+    // stable copy of s for span details, e.g. script names - interning is not cheap, do it once up front
+    static const char *intern(const std::string &s);
+
+    // name of the calling thread in the trace, allocates no ring
+    static void set_thread_name(const std::string &name);
+
+    // name and detail must outlive the tracer, use literals or intern()
+    static void record(const char *name, const char *detail, uint64_t begin_ns, uint64_t end_ns);
+
+    static uint64_t now_ns();
+
+  private:
+    static std::atomic<bool> enabled_;
+  };
+
+  // records the lifetime of the scope as a span if the tracer is enabled when the scope is entered
+  class trace_scope {
+  public:
+    explicit trace_scope(const char *name, const char *detail = nullptr)
+        : name_(name), detail_(detail), begin_(tracer::enabled() ? tracer::now_ns() : 0) {
+    }
+
+    ~trace_scope() {
+      if (begin_)
+        tracer::record(name_, detail_, begin_, tracer::now_ns());
+    }
+
+    trace_scope(const trace_scope &) = delete;
+
+    trace_scope &operator=(const trace_scope &) = delete;
+
+  private:
+    const char *name_;
+    const char *detail_;
+    uint64_t begin_;
+  };
+} // namespace lua_vm
+
+#define LVM2_TRACE_CONCAT_(a, b) a##b
+#define LVM2_TRACE_CONCAT(a, b) LVM2_TRACE_CONCAT_(a, b)
+
+#ifdef LVM2_ENABLE_TRACING
+#define LVM2_TRACE_SCOPE(name) ::lua_vm::trace_scope LVM2_TRACE_CONCAT(lvm2_trace_, __LINE__)(name)
+#define LVM2_TRACE_SCOPE_DETAIL(name, detail) \
+  ::lua_vm::trace_scope LVM2_TRACE_CONCAT(lvm2_trace_, __LINE__)(name, detail)
+#else
+#define LVM2_TRACE_SCOPE(name)
+#define LVM2_TRACE_SCOPE_DETAIL(name, detail)
+#endif
@@ -0,0 +1,431 @@
+#include <algorithm>
+#include <bit>
+#include <cmath>
+#include <cstdint>
+#include <deque>
+#include <lua.hpp>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <unordered_set>
+#include <vector>
+#include "signal_table.h"
+#include "string_hash.h"
+#pragma once
+
+namespace lua_vm {
+  enum class signal_type : uint8_t {
+    INTEGER, NUMBER, BOOLEAN, STRING // STRING holds any bytes, also blobs, or one of a set of values
+  };
+
+  inline const char *signal_type_name(signal_type type) {
+    switch (type) {
+      case signal_type::INTEGER:
+        return "integer";
+      case signal_type::NUMBER:
+        return "number";
+      case signal_type::BOOLEAN:
+        return "boolean";
+      case signal_type::STRING:
+        return "string";
+    }
+    return "?";
+  }
+
+  // Value of a typed signal. A string points to the copy interned by its table for signals with a set of values, or
+  // into blob, which keeps a free-form string alive.
+  struct signal_value {
+    signal_type type = signal_type::INTEGER;
+    union {
+      int64_t integer = 0;
+      double number;
+      bool boolean;
+      const std::string *string;
+    };
+    std::shared_ptr<const std::string> blob;
+
+    static inline signal_value of(int64_t v) {
+      signal_value value;
+      value.integer = v;
+      return value;
+    }
+
+    static inline signal_value of(double v) {
+      signal_value value;
+      value.type = signal_type::NUMBER;
+      value.number = v;
+      return value;
+    }
+
+    static inline signal_value of(bool v) {
+      signal_value value;
+      value.type = signal_type::BOOLEAN;
+      value.boolean = v;
+      return value;
+    }
+
+    // s must outlive the value, e.g. a value of a signal_spec
+    static inline signal_value of(const std::string *s) {
+      signal_value value;
+      value.type = signal_type::STRING;
+      value.string = s;
+      return value;
+    }
+
+    static inline signal_value of(std::shared_ptr<const std::string> s) {
+      signal_value value = of(s.get());
+      value.blob = std::move(s);
+      return value;
+    }
+
+    // the value as one word, what the table stores unless it is a blob
+    inline uint64_t bits() const {
+      switch (type) {
+        case signal_type::INTEGER:
+          return static_cast<uint64_t>(integer);
+        case signal_type::NUMBER:
+          return std::bit_cast<uint64_t>(number);
+        case signal_type::BOOLEAN:
+          return boolean ? 1 : 0;
+        case signal_type::STRING:
+          return reinterpret_cast<uintptr_t>(string);
+      }
+      return 0;
+    }
+
+    static inline signal_value from_bits(signal_type type, uint64_t bits) {
+      switch (type) {
+        case signal_type::INTEGER:
+          return of(static_cast<int64_t>(bits));
+        case signal_type::NUMBER:
+          return of(std::bit_cast<double>(bits));
+        case signal_type::BOOLEAN:
+          return of(bits != 0);
+        case signal_type::STRING:
+          return of(reinterpret_cast<const std::string *>(static_cast<uintptr_t>(bits)));
+      }
+      return signal_value();
+    }
+
+    // numeric view for gauges and the like: booleans are 0 or 1, strings NaN
+    inline double as_number() const {
+      switch (type) {
+        case signal_type::INTEGER:
+          return static_cast<double>(integer);
+        case signal_type::NUMBER:
+          return number;
+        case signal_type::BOOLEAN:
+          return boolean ? 1 : 0;
+        case signal_type::STRING:
+          break;
+      }
+      return NAN;
+    }
+
+    // interned strings are equal if their pointers are, blobs compare their content
+    inline bool operator==(const signal_value &other) const {
+      if (type == signal_type::STRING && other.type == signal_type::STRING && (blob || other.blob))
+        return *string == *other.string;
+      return type == other.type && bits() == other.bits();
+    }
+  };
+
+  /*
+   * Signal storage with a value type per signal, fixed when the signal is added: integer, number, boolean or
+   * string. Values are kept as one 64 bit word in a signal_table, so reads, writes, snapshots and subscriptions work
+   * as there and Lua gets native numbers and booleans.
+   *
+   * A string signal registered with a set of values (states, enumerations) only takes those. They are interned when
+   * the signal is added and the word is a pointer to the table's copy: reading one allocates nothing and equal
+   * strings compare by pointer. Any other string signal holds free-form strings or blobs. Each write publishes a new
+   * reference counted buffer that replaces the previous one, so memory stays bounded however the content changes,
+   * and the word is a write counter that makes the change visible to changes_since().
+   *
+   * The bounds of integer and number signals are checked on every write.
+   */
+  class typed_signal_table {
+  public:
+    typedef signal_table<uint64_t>::handle_t handle_t;
+
+    struct signal_spec {
+      signal_type type = signal_type::INTEGER;
+      double min = -HUGE_VAL; // inclusive bounds of INTEGER and NUMBER values
+      double max = HUGE_VAL;
+      std::vector<std::string> values; // the values a STRING signal takes, empty for free-form strings and blobs
+    };
+
+    // Adds name with spec, it starts at 0 (clamped to the bounds), false, its first value or "". Adding an existing
+    // name again returns its handle if the type is the same. Throws std::invalid_argument if the type differs or the
+    // bounds hold no value. Like signal_table::intern(), not safe while observers read.
+    handle_t add(std::string_view name, signal_spec spec) {
+      if (spec.min > spec.max)
+        throw std::invalid_argument("signal " + std::string(name) + " has min > max");
+      if (spec.type == signal_type::INTEGER && std::ceil(spec.min) > std::floor(spec.max))
+        throw std::invalid_argument("signal " + std::string(name) + " has no integer in its bounds");
+      if (values_.contains(name)) {
+        handle_t h = values_.handle(name);
+        if (info_[h].spec.type != spec.type)
+          throw std::invalid_argument("signal " + std::string(name) + " already is a " +
+                                      signal_type_name(info_[h].spec.type) + " signal");
+        return h;
+      }
+      signal_info info{spec, {}, no_blob};
+      uint64_t initial = 0;
+      if (spec.type == signal_type::INTEGER) {
+        initial = signal_value::of(static_cast<int64_t>(std::clamp(0.0, std::ceil(spec.min), std::floor(spec.max))))
+            .bits();
+      } else if (spec.type == signal_type::NUMBER) {
+        initial = signal_value::of(std::clamp(0.0, spec.min, spec.max)).bits();
+      } else if (spec.type == signal_type::STRING && !spec.values.empty()) {
+        for (auto &value: spec.values)
+          info.values.push_back(intern(value));
+        initial = signal_value::of(info.values.front()).bits();
+      } else if (spec.type == signal_type::STRING) {
+        info.blob = blobs_.size();
+        blobs_.emplace_back(empty_string());
+      }
+      handle_t h = values_.intern(name, initial);
+      info_.push_back(std::move(info));
+      return h;
+    }
+
+    inline handle_t handle(std::string_view name) const {
+      return values_.handle(name);
+    }
+
+    inline bool contains(std::string_view name) const {
+      return values_.contains(name);
+    }
+
+    inline handle_t checked(lua_Integer h) const {
+      return values_.checked(h);
+    }
+
+    inline const std::string &name(handle_t h) const {
+      return values_.name(h);
+    }
+
+    inline const std::vector<std::string> &names() const {
+      return values_.names();
+    }
+
+    inline size_t size() const {
+      return values_.size();
+    }
+
+    inline void reserve(size_t n) {
+      values_.reserve(n);
+      info_.reserve(n);
+    }
+
+    inline const signal_spec &spec(handle_t h) const {
+      return info_[h].spec;
+    }
+
+    // a free-form string is shared with the table, the value keeps it alive after later writes
+    inline signal_value get(handle_t h) const {
+      if (info_[h].blob != no_blob)
+        return signal_value::of(blobs_[info_[h].blob].load(std::memory_order_acquire));
+      return signal_value::from_bits(info_[h].spec.type, values_.get(h));
+    }
+
+    // Throws std::invalid_argument if value does not have the type of h or is not one of its values,
+    // std::out_of_range if it is out of bounds
+    void validate(handle_t h, const signal_value &value) const {
+      auto &spec = info_[h].spec;
+      if (value.type != spec.type)
+        throw std::invalid_argument("signal " + name(h) + " takes " + signal_type_name(spec.type) + " values, not " +
+                                    signal_type_name(value.type));
+      if (value.type == signal_type::INTEGER || value.type == signal_type::NUMBER) {
+        double v = value.as_number();
+        if (!(v >= spec.min && v <= spec.max))
+          throw std::out_of_range("value " + std::to_string(v) + " of signal " + name(h) + " is out of [" +
+                                  std::to_string(spec.min) + ", " + std::to_string(spec.max) + "]");
+      }
+      if (value.type == signal_type::STRING && !info_[h].values.empty())
+        check_enum_value(h, *value.string);
+    }
+
+    // true if the value changed, throws as validate()
+    bool set(handle_t h, const signal_value &value) {
+      validate(h, value);
+      auto &info = info_[h];
+      if (info.blob != no_blob)
+        return set_blob(h, value.blob ? value.blob : std::make_shared<const std::string>(*value.string));
+      if (!info.values.empty())
+        return values_.set(h, signal_value::of(check_enum_value(h, *value.string)).bits());
+      return values_.set(h, value.bits());
+    }
+
+    // integers are taken by number signals too
+    inline bool set(handle_t h, int64_t value) {
+      if (info_[h].spec.type == signal_type::NUMBER)
+        return set(h, signal_value::of(static_cast<double>(value)));
+      return set(h, signal_value::of(value));
+    }
+
+    inline bool set(handle_t h, double value) {
+      return set(h, signal_value::of(value));
+    }
+
+    inline bool set(handle_t h, bool value) {
+      return set(h, signal_value::of(value));
+    }
+
+    // an int would be as close to bool and double as to int64_t
+    inline bool set(handle_t h, int value) {
+      return set(h, static_cast<int64_t>(value));
+    }
+
+    bool set(handle_t h, std::string_view value) {
+      auto &info = info_[h];
+      if (info.spec.type != signal_type::STRING)
+        throw std::invalid_argument("signal " + name(h) + " takes " + signal_type_name(info.spec.type) +
+                                    " values, not string");
+      if (info.blob != no_blob)
+        return set_blob(h, std::make_shared<const std::string>(value));
+      return values_.set(h, signal_value::of(check_enum_value(h, value)).bits());
+    }
+
+    // a pointer would convert to bool before string_view
+    inline bool set(handle_t h, const char *value) {
+      return set(h, std::string_view(value));
+    }
+
+    inline int event(handle_t h) const {
+      return values_.event(h);
+    }
+
+    inline uint64_t version() const {
+      return values_.version();
+    }
+
+    // as signal_table::changes_since(), calls fn(handle, signal_value); a free-form string may be newer than the
+    // version returned
+    template<typename F>
+    uint64_t changes_since(uint64_t since, F &&fn) const {
+      return values_.changes_since(since, [&](handle_t h, uint64_t bits) {
+        if (info_[h].blob != no_blob)
+          fn(h, get(h));
+        else
+          fn(h, signal_value::from_bits(info_[h].spec.type, bits));
+      });
+    }
+
+    inline handle_t lua_check_handle(lua_State *L, int arg) const {
+      return values_.lua_check_handle(L, arg);
+    }
+
+    // pushes the value of h as a Lua integer, number, boolean or string
+    void lua_push(lua_State *L, handle_t h) const {
+      auto value = get(h);
+      switch (value.type) {
+        case signal_type::INTEGER:
+          lua_pushinteger(L, value.integer);
+          break;
+        case signal_type::NUMBER:
+          lua_pushnumber(L, value.number);
+          break;
+        case signal_type::BOOLEAN:
+          lua_pushboolean(L, value.boolean);
+          break;
+        case signal_type::STRING:
+          lua_pushlstring(L, value.string->data(), value.string->size());
+          break;
+      }
+    }
+
+    // Argument arg of a Lua call as a value for h, raises a Lua error if it has the wrong type. Bounds and the values
+    // of a string signal are checked by set() or validate().
+    signal_value lua_check_value(lua_State *L, handle_t h, int arg) {
+      switch (info_[h].spec.type) {
+        case signal_type::INTEGER:
+          return signal_value::of(static_cast<int64_t>(luaL_checkinteger(L, arg)));
+        case signal_type::NUMBER:
+          return signal_value::of(static_cast<double>(luaL_checknumber(L, arg)));
+        case signal_type::BOOLEAN:
+          luaL_checktype(L, arg, LUA_TBOOLEAN);
+          return signal_value::of(lua_toboolean(L, arg) != 0);
+        case signal_type::STRING: {
+          size_t len = 0;
+          const char *s = luaL_checklstring(L, arg, &len);
+          std::string_view text(s, len);
+          if (info_[h].blob != no_blob)
+            return signal_value::of(std::make_shared<const std::string>(text));
+          // the interned copy if it is a value of h, Lua's string is only valid while it is on the stack
+          for (auto value: info_[h].values) {
+            if (*value == text)
+              return signal_value::of(value);
+          }
+          return signal_value::of(std::make_shared<const std::string>(text)); // for validate() to reject
+        }
+      }
+      return signal_value();
+    }
+
+    // subscribe(signal, fn) as signal_table::lua_subscribe(), fn gets the typed value
+    inline int lua_subscribe(lua_State *L) {
+      return values_.lua_subscribe(L, on_change, this);
+    }
+
+  private:
+    static constexpr size_t no_blob = SIZE_MAX;
+
+    struct signal_info {
+      signal_spec spec;
+      std::vector<const std::string *> values; // interned spec.values
+      size_t blob;                             // index in blobs_ of a free-form string signal, else no_blob
+    };
+
+    static const std::shared_ptr<const std::string> &empty_string() {
+      static const auto empty = std::make_shared<const std::string>();
+      return empty;
+    }
+
+    // the table's copy of s
+    const std::string *intern(std::string_view s) {
+      std::lock_guard<std::mutex> lock(strings_mutex_);
+      auto it = strings_.find(s);
+      if (it == strings_.end())
+        it = strings_.emplace(s).first;
+      return &*it;
+    }
+
+    // the interned value of h equal to s, throws std::invalid_argument if there is none
+    const std::string *check_enum_value(handle_t h, std::string_view s) const {
+      for (auto value: info_[h].values) {
+        if (*value == s)
+          return value;
+      }
+      throw std::invalid_argument("\"" + std::string(s) + "\" is not a value of signal " + name(h));
+    }
+
+    // publishes the new buffer of a free-form string signal, then counts the write so observers see the change
+    bool set_blob(handle_t h, std::shared_ptr<const std::string> s) {
+      auto &blob = blobs_[info_[h].blob];
+      if (*blob.load(std::memory_order_acquire) == *s)
+        return false;
+      blob.store(std::move(s), std::memory_order_release);
+      values_.set(h, blob_writes_.fetch_add(1, std::memory_order_relaxed) + 1);
+      return true;
+    }
+
+    static int on_change(lua_State *L) {
+      auto table = static_cast<const typed_signal_table *>(lua_touserdata(L, lua_upvalueindex(1)));
+      auto h = static_cast<handle_t>(lua_tointeger(L, lua_upvalueindex(2)));
+      lua_pushvalue(L, lua_upvalueindex(3));
+      table->lua_push(L, h);
+      lua_call(L, 1, 0);
+      return 0;
+    }
+
+    signal_table<uint64_t> values_;
+    std::vector<signal_info> info_; // by handle
+    std::deque<std::atomic<std::shared_ptr<const std::string>>> blobs_; // never moved, readers load concurrently
+    std::atomic<uint64_t> blob_writes_ = 0;
+    std::mutex strings_mutex_;
+    std::unordered_set<std::string, string_hash, std::equal_to<>> strings_; // values of all string signals
+  };
+} // namespace lua_vm
@@ -0,0 +1,51 @@
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+#pragma once
+
+namespace lua_vm {
+  struct lua_script;
+
+  /*
+   * Enforces script budgets from a separate thread, so scripts run without a count hook.
+   *
+   * Scripts publish the phase they are in (lua_script::begin_phase()). Every period the watchdog checks the running
+   * phases against their budget, using the CPU clock of the thread executing the script. A phase is timed from the
+   * watchdog's first look at it, so scripts never read the clock themselves and up to one period is not counted.
+   * Only when a phase runs over its hard limit does it install a one shot hook on the script's Lua threads that
+   * raises the timeout error.
+   */
+  class watchdog {
+  public:
+    explicit watchdog(std::chrono::microseconds period);
+
+    ~watchdog();
+
+    watchdog(const watchdog &) = delete;
+
+    watchdog &operator=(const watchdog &) = delete;
+
+    void watch(lua_script *script);
+
+    // the watchdog no longer touches script when this returns
+    void unwatch(lua_script *script);
+
+    inline std::chrono::microseconds period() const {
+      return period_;
+    }
+
+  private:
+    void run();
+
+    void check(lua_script *script, int64_t now_ns);
+
+    const std::chrono::microseconds period_;
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    bool stop_ = false;
+    std::vector<lua_script *> scripts_;
+    std::thread thread_; // last, starts after the members above are initialized
+  };
+} // namespace lua_vm
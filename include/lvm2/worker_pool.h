@@ -0,0 +1,59 @@
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#pragma once
+
+namespace lua_vm {
+  /*
+   * A fixed set of worker threads executing index ranges in parallel.
+   *
+   * parallel_for() splits [0, n) into one shard per participant (the workers plus the calling thread). Items are
+   * claimed one by one from a shared cursor, so a participant that has drained its own shard can steal the
+   * remaining items of the others - one slow item does not hold back the rest of its shard.
+   */
+  class worker_pool {
+  public:
+    // nr_of_threads is the number of extra threads, the caller of parallel_for() is always a participant
+    explicit worker_pool(size_t nr_of_threads);
+
+    ~worker_pool();
+
+    worker_pool(const worker_pool &) = delete;
+
+    worker_pool &operator=(const worker_pool &) = delete;
+
+    // Calls fn(ix) exactly once for each ix in [0, n) and returns when all calls are done.
+    // fn must not throw and must not call parallel_for() recursively.
+    void parallel_for(size_t n, const std::function<void(size_t)> &fn);
+
+    inline size_t nr_of_participants() const {
+      return threads_.size() + 1;
+    }
+
+  private:
+    struct alignas(64) shard {
+      std::atomic<size_t> next{0};
+      size_t end = 0;
+    };
+
+    void worker_main(size_t participant);
+
+    void run_participant(size_t participant);
+
+    std::vector<std::thread> threads_;
+    std::unique_ptr<shard[]> shards_;
+
+    std::mutex mutex_;
+    std::condition_variable start_cv_;
+    std::condition_variable done_cv_;
+    const std::function<void(size_t)> *job_ = nullptr;
+    uint64_t generation_ = 0;
+    size_t busy_ = 0;
+    bool stop_ = false;
+  };
+} // namespace lua_vm
@@ -0,0 +1,197 @@
+#include <lvm2/chunk_cache.h>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <sstream>
+#include <glog/logging.h>
+
+namespace fs = std::filesystem;
+
+namespace lua_vm {
+  static int string_writer(lua_State *L, const void *p, size_t sz, void *ud) {
+    static_cast<std::string *>(ud)->append(static_cast<const char *>(p), sz);
+    return 0;
+  }
+
+  namespace {
+    // Precedes the bytecode in a cache file. Lua does not validate bytecode it undumps, so a file is only loaded if
+    // its header matches what the cache would have written for the source.
+    struct file_header {
+      char magic[8];
+      uint32_t lua_version;
+      uint32_t reserved;
+      uint64_t source_length;
+      uint64_t key;
+      uint64_t bytecode_length; // what follows, a shorter file was not written completely
+    };
+
+    constexpr char file_magic[8] = {'L', 'V', 'M', '2', 'C', 'H', 'K', '1'};
+
+    file_header header_of(uint64_t key, size_t source_length, size_t bytecode_length) {
+      file_header header{};
+      std::memcpy(header.magic, file_magic, sizeof(file_magic));
+      header.lua_version = LUA_VERSION_NUM;
+      header.source_length = source_length;
+      header.key = key;
+      header.bytecode_length = bytecode_length;
+      return header;
+    }
+  } // namespace
+
+  chunk_cache::chunk_cache(std::string cache_dir, size_t memory_limit)
+      : cache_dir_(std::move(cache_dir)), memory_limit_(memory_limit) {
+    if (!cache_dir_.empty())
+      fs::create_directories(cache_dir_);
+  }
+
+  uint64_t chunk_cache::hash(std::string_view chunkname, std::string_view source) {
+    // FNV-1a, the chunk name is part of the key since it ends up in the debug info of the bytecode
+    uint64_t h = 14695981039346656037ull;
+    for (char c: chunkname)
+      h = (h ^ static_cast<unsigned char>(c)) * 1099511628211ull;
+    h = (h ^ 0xff) * 1099511628211ull;
+    for (char c: source)
+      h = (h ^ static_cast<unsigned char>(c)) * 1099511628211ull;
+    return h;
+  }
+
+  int chunk_cache::load(lua_State *L, std::string_view source, const std::string &chunkname) {
+    const uint64_t key = hash(chunkname, source);
+
+    if (auto bytecode = find(key, source.size())) {
+      if (luaL_loadbufferx(L, bytecode->data(), bytecode->size(), chunkname.c_str(), "b") == LUA_OK) {
+        ++hits_;
+        return LUA_OK;
+      }
+      // e.g. written by another Lua version - compile from source instead
+      LOG(WARNING) << "dropping cached chunk for " << chunkname << ": " << lua_tostring(L, -1);
+      lua_pop(L, 1);
+      drop(key);
+    }
+
+    ++misses_;
+    int status = luaL_loadbuffer(L, source.data(), source.size(), chunkname.c_str());
+    if (status != LUA_OK)
+      return status;
+
+    // keep the debug info, error messages and the timeout hook report source lines
+    auto bytecode = std::make_shared<std::string>();
+    if (lua_dump(L, string_writer, bytecode.get(), 0) == 0)
+      store(key, source.size(), std::move(bytecode));
+    return LUA_OK;
+  }
+
+  std::shared_ptr<const std::string> chunk_cache::find(uint64_t key, size_t source_length) {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      auto it = chunks_.find(key);
+      if (it != chunks_.end()) {
+        lru_.splice(lru_.begin(), lru_, it->second.lru);
+        return it->second.bytecode;
+      }
+    }
+
+    if (cache_dir_.empty())
+      return nullptr;
+    std::ifstream in(path_of(key), std::ios::binary);
+    if (!in)
+      return nullptr;
+    file_header header;
+    bool valid = static_cast<bool>(in.read(reinterpret_cast<char *>(&header), sizeof(header)));
+    if (valid) {
+      auto expected = header_of(key, source_length, header.bytecode_length);
+      valid = std::memcmp(&header, &expected, sizeof(header)) == 0;
+    }
+    std::ostringstream oss;
+    if (valid) {
+      oss << in.rdbuf();
+      valid = oss.str().size() == header.bytecode_length;
+    }
+    if (!valid) {
+      LOG(WARNING) << "ignoring invalid chunk cache file " << path_of(key);
+      return nullptr;
+    }
+    auto bytecode = std::make_shared<const std::string>(oss.str());
+    std::lock_guard<std::mutex> lock(mutex_);
+    insert(key, bytecode);
+    return bytecode;
+  }
+
+  void chunk_cache::store(uint64_t key, size_t source_length, std::shared_ptr<const std::string> bytecode) {
+    if (!cache_dir_.empty()) {
+      // write to a temporary and rename, a concurrent reader never sees a partial file
+      auto path = path_of(key);
+      auto tmp = path + ".tmp" + std::to_string(reinterpret_cast<uintptr_t>(bytecode.get()));
+      bool written;
+      {
+        auto header = header_of(key, source_length, bytecode->size());
+        std::ofstream out(tmp, std::ios::binary | std::ios::trunc);
+        out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+        out.write(bytecode->data(), (std::streamsize) bytecode->size());
+        out.close();
+        written = out.good(); // e.g. a full disk, a short file must not be published
+      }
+      std::error_code ec;
+      if (written)
+        fs::rename(tmp, path, ec);
+      if (!written || ec) {
+        LOG(WARNING) << "could not write chunk cache " << path << (ec ? ": " + ec.message() : "");
+        fs::remove(tmp, ec);
+      }
+    }
+    std::lock_guard<std::mutex> lock(mutex_);
+    insert(key, std::move(bytecode));
+  }
+
+  void chunk_cache::insert(uint64_t key, std::shared_ptr<const std::string> bytecode) {
+    erase(key);
+    bytes_ += bytecode->size();
+    lru_.push_front(key);
+    chunks_.emplace(key, entry{std::move(bytecode), lru_.begin()});
+    // the newest chunk stays even if it alone is over the limit
+    while (bytes_ > memory_limit_ && lru_.size() > 1)
+      erase(lru_.back());
+  }
+
+  void chunk_cache::erase(uint64_t key) {
+    auto it = chunks_.find(key);
+    if (it == chunks_.end())
+      return;
+    bytes_ -= it->second.bytecode->size();
+    lru_.erase(it->second.lru);
+    chunks_.erase(it);
+  }
+
+  size_t chunk_cache::size() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return chunks_.size();
+  }
+
+  size_t chunk_cache::bytes() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return bytes_;
+  }
+
+  void chunk_cache::release(uint64_t key) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    erase(key);
+  }
+
+  void chunk_cache::drop(uint64_t key) {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      erase(key);
+    }
+    if (!cache_dir_.empty()) {
+      std::error_code ec;
+      fs::remove(path_of(key), ec);
+    }
+  }
+
+  std::string chunk_cache::path_of(uint64_t key) const {
+    char name[32];
+    snprintf(name, sizeof(name), "%016llx.luac", (unsigned long long) key);
+    return (fs::path(cache_dir_) / name).string();
+  }
+} // namespace lua_vm
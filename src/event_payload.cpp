@@ -0,0 +1,194 @@
+#include <lvm2/event_payload.h>
+#include <cstring>
+#include <stdexcept>
+
+namespace lua_vm {
+  namespace {
+    enum tag_t : uint8_t {
+      NIL, FALSE, TRUE, INTEGER, NUMBER, STRING, TABLE, END
+    };
+
+    void put_varint(std::string &out, uint64_t v) {
+      while (v >= 0x80) {
+        out += static_cast<char>(v | 0x80);
+        v >>= 7;
+      }
+      out += static_cast<char>(v);
+    }
+
+    // zigzag, so small negative integers stay short too
+    void put_integer(std::string &out, lua_Integer v) {
+      uint64_t u = static_cast<uint64_t>(v);
+      put_varint(out, (u << 1) ^ (v < 0 ? ~uint64_t(0) : 0));
+    }
+
+    void put_number(std::string &out, lua_Number v) {
+      char raw[sizeof(v)];
+      std::memcpy(raw, &v, sizeof(v));
+      out.append(raw, sizeof(v));
+    }
+
+    void put_string(std::string &out, std::string_view s) {
+      put_varint(out, s.size());
+      out.append(s);
+    }
+
+    void serialize(lua_State *L, int idx, int depth, std::string &out) {
+      switch (lua_type(L, idx)) {
+        case LUA_TNIL:
+        case LUA_TNONE:
+          out += static_cast<char>(NIL);
+          break;
+        case LUA_TBOOLEAN:
+          out += static_cast<char>(lua_toboolean(L, idx) ? TRUE : FALSE);
+          break;
+        case LUA_TNUMBER:
+          if (lua_isinteger(L, idx)) {
+            out += static_cast<char>(INTEGER);
+            put_integer(out, lua_tointeger(L, idx));
+          } else {
+            out += static_cast<char>(NUMBER);
+            put_number(out, lua_tonumber(L, idx));
+          }
+          break;
+        case LUA_TSTRING: {
+          size_t len;
+          const char *s = lua_tolstring(L, idx, &len);
+          out += static_cast<char>(STRING);
+          put_string(out, std::string_view(s, len));
+          break;
+        }
+        case LUA_TTABLE: {
+          if (depth >= event_payload::max_depth)
+            throw std::invalid_argument("event payload nested too deep");
+          if (!lua_checkstack(L, 2))
+            throw std::invalid_argument("event payload nested too deep");
+          idx = lua_absindex(L, idx);
+          out += static_cast<char>(TABLE);
+          lua_pushnil(L);
+          while (lua_next(L, idx) != 0) {
+            try {
+              serialize(L, -2, depth + 1, out);
+              serialize(L, -1, depth + 1, out);
+            }
+            catch (...) {
+              lua_pop(L, 2);
+              throw;
+            }
+            lua_pop(L, 1);
+          }
+          out += static_cast<char>(END);
+          break;
+        }
+        default:
+          throw std::invalid_argument(std::string("event payload cannot hold a ") + lua_typename(L, lua_type(L, idx)));
+      }
+    }
+
+    struct reader {
+      const char *p;
+      const char *end;
+
+      uint64_t varint() {
+        uint64_t v = 0;
+        for (unsigned shift = 0; p != end; shift += 7) {
+          uint8_t b = static_cast<uint8_t>(*p++);
+          v |= static_cast<uint64_t>(b & 0x7f) << shift;
+          if (!(b & 0x80))
+            break;
+        }
+        return v;
+      }
+
+      // pushes the next value, returns false at the END of a table
+      bool push(lua_State *L) {
+        switch (static_cast<tag_t>(*p++)) {
+          case NIL:
+            lua_pushnil(L);
+            return true;
+          case FALSE:
+            lua_pushboolean(L, 0);
+            return true;
+          case TRUE:
+            lua_pushboolean(L, 1);
+            return true;
+          case INTEGER: {
+            uint64_t u = varint();
+            lua_pushinteger(L, static_cast<lua_Integer>((u >> 1) ^ (~(u & 1) + 1)));
+            return true;
+          }
+          case NUMBER: {
+            lua_Number v;
+            std::memcpy(&v, p, sizeof(v));
+            p += sizeof(v);
+            lua_pushnumber(L, v);
+            return true;
+          }
+          case STRING: {
+            size_t len = varint();
+            lua_pushlstring(L, p, len);
+            p += len;
+            return true;
+          }
+          case TABLE:
+            luaL_checkstack(L, 3, "event payload");
+            lua_newtable(L);
+            while (push(L)) {
+              push(L);
+              lua_rawset(L, -3);
+            }
+            return true;
+          case END:
+            return false;
+        }
+        return false;
+      }
+    };
+  } // namespace
+
+  event_payload_ptr event_payload::from_lua(lua_State *L, int idx) {
+    auto payload = std::make_shared<event_payload>();
+    serialize(L, idx, 0, payload->bytes_);
+    return payload;
+  }
+
+  event_payload_ptr event_payload::of(bool value) {
+    auto payload = std::make_shared<event_payload>();
+    payload->bytes_ += static_cast<char>(value ? TRUE : FALSE);
+    return payload;
+  }
+
+  event_payload_ptr event_payload::of(lua_Integer value) {
+    auto payload = std::make_shared<event_payload>();
+    payload->bytes_ += static_cast<char>(INTEGER);
+    put_integer(payload->bytes_, value);
+    return payload;
+  }
+
+  event_payload_ptr event_payload::of(lua_Number value) {
+    auto payload = std::make_shared<event_payload>();
+    payload->bytes_ += static_cast<char>(NUMBER);
+    put_number(payload->bytes_, value);
+    return payload;
+  }
+
+  event_payload_ptr event_payload::of(std::string_view value) {
+    auto payload = std::make_shared<event_payload>();
+    payload->bytes_ += static_cast<char>(STRING);
+    put_string(payload->bytes_, value);
+    return payload;
+  }
+
+  int event_payload::push_unprotected(lua_State *L) {
+    auto payload = static_cast<const event_payload *>(lua_touserdata(L, 1));
+    reader r{payload->bytes_.data(), payload->bytes_.data() + payload->bytes_.size()};
+    r.push(L);
+    return 1;
+  }
+
+  int event_payload::push(lua_State *L) const {
+    lua_pushcfunction(L, push_unprotected);
+    lua_pushlightuserdata(L, const_cast<event_payload *>(this));
+    return lua_pcall(L, 1, 1, 0);
+  }
+} // namespace lua_vm
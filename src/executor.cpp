@@ -1,12 +1,22 @@
 #include <lvm2/executor.h>
+#include <algorithm>
 #include <filesystem>
+#include <fstream>
+#include <sstream>
 #include <glog/logging.h>
 
 namespace fs = std::filesystem;
 using namespace std::chrono_literals;
 
-#define THIS_SCRIPT "thisScript"
-#define THIS_EXECUTOR   "thisExecutor"
+// how often await() re-checks a condition that was false in a coroutine the executor does not schedule. A task
+// parks until something changed instead, and re-checks after this at the latest for dataplanes that never call
+// executor::notify_change().
+static constexpr auto await_poll_interval = 100ms;
+
+// number of Lua instructions between calls of the instruction count hook, until it adapts to the script's speed
+static constexpr int hook_instruction_count = 100000;
+static constexpr int min_hook_instruction_count = 1000;
+static constexpr int max_hook_instruction_count = 1000000;
 
 inline int64_t now() {
   auto now = std::chrono::system_clock::now(); // Get the current point in time
@@ -16,84 +26,91 @@ inline int64_t now() {
 }
 
 namespace lua_vm {
+  // nullptr in a state that is not (yet) owned by a script, e.g. a prewarmed one
   static inline lua_script *this_lua_script(lua_State *L) {
-    lua_getglobal(L, THIS_SCRIPT);
-    lua_script *script = *(lua_script **) lua_touserdata(L, -1);
-    lua_pop(L, 1); // Pop userdata from stack
-    return script;
+    return state_object<lua_script>(L);
   }
 
   static inline executor *this_lua_executor(lua_State *L) {
-    lua_getglobal(L, THIS_EXECUTOR);
-    executor *vm = *(executor **) lua_touserdata(L, -1);
-    lua_pop(L, 1); // Pop userdata from stack
-    return vm;
+    lua_script *script = this_lua_script(L);
+    return script ? script->exec : nullptr;
   }
 
   executor::executor(std::function<void(lua_State *)> bind_lua_script_to_dataplane)
-      : bind_lua_script_to_dataplane_(bind_lua_script_to_dataplane), total_ops_(0) {
+      : bind_lua_script_to_dataplane_(bind_lua_script_to_dataplane), chunk_cache_(std::make_shared<chunk_cache>()),
+        total_ops_(0) {
+  }
+
+  executor::~executor() {
+    script_watcher_.reset();
+    for (auto L: state_pool_)
+      close_lua_state(L);
   }
 
   void instruction_count_hook(lua_State *L, lua_Debug *ar) {
-    // LOG(INFO) << "time_limit_hook";
     auto p = this_lua_script(L);
-    auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::high_resolution_clock::now() -
-                                                                          p->ts_begin_loop)
-        .count();
-    if (duration > 10) {
-      LOG(WARNING) << "script takes to long - injecting timeout error...";
-      lua_getinfo(L, "Sl", ar); // Get source and line number
-      luaL_error(L, "timeout: at %s:%d", ar->short_src, ar->currentline);
+    const int count = lua_gethookcount(L);
+    script_metrics::add(p->metrics.instructions, count);
+    if (p->profiling)
+      p->profile->sample(L);
+    if (p->phase == lua_script::IDLE || p->watched_by)
+      return; // budgets are checked by the watchdog
+
+    auto now = thread_cpu_time();
+    if (p->phase_begin.count() == 0) {
+      // the phase's clock starts at its first hook, a phase ending before it never reads the clock
+      p->phase_begin = now;
+      p->last_hook = now;
+      return;
+    }
+    auto since_last = now - p->last_hook;
+    bool adapt = p->last_hook != p->phase_begin; // only the rate within this phase is meaningful
+    p->last_hook = now;
+
+    auto elapsed = now - p->phase_begin;
+    if (elapsed > p->phase_budget) {
+      if (p->budget.mode == script_budget::HARD || elapsed > p->phase_budget * p->budget.hard_limit_factor) {
+        LOG(WARNING) << p->name << " takes to long - injecting timeout error...";
+        script_metrics::add(p->metrics.timeouts);
+        lua_getinfo(L, "Sl", ar); // Get source and line number
+        luaL_error(L, "timeout: at %s:%d", ar->short_src, ar->currentline);
+      }
+      if (!p->phase_overrun) {
+        LOG(WARNING) << p->name << " exceeded its budget of " << p->phase_budget.count() / 1000 << "us";
+        p->phase_overrun = true;
+        p->tick_overrun = true;
+        script_metrics::add(p->metrics.budget_overruns);
+      }
+    }
+
+    // next call within tolerance at the speed since the last one, profiling needs the fixed interval
+    if (adapt && !p->profiling && since_last.count() > 0) {
+      auto tolerance = std::chrono::duration_cast<std::chrono::nanoseconds>(p->budget.tolerance);
+      double next = (double) count * tolerance.count() / since_last.count();
+      next = std::clamp(next, (double) min_hook_instruction_count, (double) max_hook_instruction_count);
+      if (next < count / 2 || next > count * 2)
+        lua_sethook(L, instruction_count_hook, LUA_MASKCOUNT, (int) next);
     }
   }
 
-  lua_script::lua_script(executor *lvenv)
-      : L(luaL_newstate()), initFunctionRef(LUA_NOREF), loopFunctionRef(LUA_NOREF),
-        ts_begin_loop(std::chrono::high_resolution_clock::now()) {
-    //luaL_openlibs(L);
-    executor::lua_load_libraries(L);
-    executor::lua_register_event_functions(L);
-
-    // Store LuaScript* as userdata in Lua state
-    lua_script **userdata1 = (lua_script **) lua_newuserdata(L, sizeof(lua_script *));
-    *userdata1 = this;
-    lua_setglobal(L, THIS_SCRIPT);
-    // Store LuaScript* as userdata in Lua state
-    executor **userdata2 = (executor **) lua_newuserdata(L, sizeof(executor *));
-    *userdata2 = lvenv;
-    lua_setglobal(L, THIS_EXECUTOR); // refers to executor script is running in
+  lua_script::lua_script(executor *lvenv, lua_State *prewarmed)
+      : exec(lvenv), L(prewarmed ? prewarmed : executor::new_lua_state()), initFunctionRef(LUA_NOREF), loopFunctionRef(LUA_NOREF),
+        ts_begin_loop(std::chrono::high_resolution_clock::now()), hook_count(hook_instruction_count) {
+    // take over the allocator of states made by new_lua_state()
+    void *ud = nullptr;
+    if (lua_getallocf(L, &ud) == script_allocator::lua_alloc)
+      allocator.reset(static_cast<script_allocator *>(ud));
+
+    // the bindings find the script (and its executor) in the extra space of L and its coroutines
+    set_state_object(L, this);
 
     // Set the debug hook
-    const int instruction_count = 100000; // Number of Lua instructions before the hook is called
-    lua_sethook(L, instruction_count_hook, LUA_MASKCOUNT, instruction_count);
-
-    // define stuff I cannot write in C++
-    std::string async_script = R"(
-        function asleep(milliseconds)
-            local t1 = now() + milliseconds
-            while now() < t1 do
-                coroutine.yield()
-            end
-        end
-
-        function await(status)
-          if (status == false) then
-            asleep(100)
-          end
-          return status
-        end
-    )";
-
-    // Run the Lua script, defining the 'asleep' function within the Lua environment
-    if (luaL_dostring(L, async_script.c_str()) != LUA_OK) {
-      // Handle error
-      const char* errorMessage = lua_tostring(L, -1);
-      LOG(FATAL) << "Error running Lua script: " << errorMessage;
-      lua_pop(L, 1); // Remove error message from the stack
-    }
+    lua_sethook(L, instruction_count_hook, LUA_MASKCOUNT, hook_instruction_count);
   }
 
   lua_script::~lua_script() {
+    if (watched_by)
+      watched_by->unwatch(this);
     if (initFunctionRef != LUA_NOREF) {
       luaL_unref(L, LUA_REGISTRYINDEX, initFunctionRef);
     }
@@ -115,8 +132,39 @@ namespace lua_vm {
     }
   }
 
-  bool lua_script::loadAndExecuteFile(const std::string &path) {
-    if (luaL_loadfile(L, path.c_str()) == LUA_OK && lua_pcall(L, 0, 0, 0) == LUA_OK) {
+  // The source of a script file as luaL_loadfile() sees it: a first line starting with # (e.g. #!/usr/bin/lua) is
+  // blanked, its newline is kept so line numbers stay right. false if the file cannot be read.
+  static bool read_script_source(const std::string &path, std::string &source) {
+    std::ifstream in(path, std::ios::binary);
+    if (!in)
+      return false;
+    std::ostringstream text;
+    text << in.rdbuf();
+    source = text.str();
+    if (!source.empty() && source[0] == '#')
+      source.erase(0, source.find('\n'));
+    return true;
+  }
+
+  bool lua_script::loadAndExecuteFile(const std::string &path, chunk_cache *cache) {
+    int status;
+    if (cache) {
+      std::string source;
+      if (!read_script_source(path, source)) {
+        LOG(ERROR) << "Error loading/executing script: cannot open " << path;
+        return false;
+      }
+      chunk_key = chunk_cache::hash("@" + path, source);
+      status = cache->load(L, source, "@" + path);
+    } else {
+      status = luaL_loadfile(L, path.c_str());
+    }
+    if (status == LUA_OK) {
+      begin_phase(INIT);
+      status = lua_pcall(L, 0, 0, 0);
+      end_phase();
+    }
+    if (status == LUA_OK) {
       return loadAndReferenceFunction("init", initFunctionRef) && loadAndReferenceFunction("loop", loopFunctionRef);
     } else {
       LOG(ERROR) << "Error loading/executing script: " << lua_tostring(L, -1);
@@ -125,8 +173,16 @@ namespace lua_vm {
     }
   }
 
-  bool lua_script::loadAndExecuteFromBuffer(const std::string &buffer) {
-    if (luaL_loadbuffer(L, buffer.c_str(), buffer.size(), "buffer") == LUA_OK && lua_pcall(L, 0, 0, 0) == LUA_OK) {
+  bool lua_script::loadAndExecuteFromBuffer(const std::string &buffer, chunk_cache *cache) {
+    if (cache)
+      chunk_key = chunk_cache::hash("buffer", buffer);
+    int status = cache ? cache->load(L, buffer, "buffer") : luaL_loadbuffer(L, buffer.c_str(), buffer.size(), "buffer");
+    if (status == LUA_OK) {
+      begin_phase(INIT);
+      status = lua_pcall(L, 0, 0, 0);
+      end_phase();
+    }
+    if (status == LUA_OK) {
       return loadAndReferenceFunction("init", initFunctionRef) && loadAndReferenceFunction("loop", loopFunctionRef);
     } else {
       LOG(ERROR) << "Error loading/executing script from buffer: " << lua_tostring(L, -1);
@@ -136,63 +192,323 @@ namespace lua_vm {
   }
 
 
-  void lua_script::event_publish(int eventid) {
-    event_queue.emplace(eventid);
+  void lua_script::set_name(const std::string &script_name) {
+    name = script_name;
+    trace_name = tracer::intern(name);
+  }
+
+  void lua_script::set_hook_count(int count) {
+    hook_count = count;
+    lua_Hook hook = count ? instruction_count_hook : nullptr;
+    lua_sethook(L, hook, count ? LUA_MASKCOUNT : 0, count);
+    // coroutines copy the hook when they are created, update the ones we know of
+    for (auto &[id, task]: tasks)
+      lua_sethook(task.co, hook, count ? LUA_MASKCOUNT : 0, count);
+  }
+
+  static inline int64_t to_ns(std::chrono::nanoseconds d) {
+    return d.count();
+  }
+
+  static clockid_t this_thread_cpu_clock() {
+    thread_local clockid_t clock = [] {
+      clockid_t id;
+      return pthread_getcpuclockid(pthread_self(), &id) == 0 ? id : CLOCK_THREAD_CPUTIME_ID;
+    }();
+    return clock;
+  }
+
+  void lua_script::begin_phase(phase_t p) {
+    phase = p;
+    switch (p) {
+      case INIT:
+        phase_budget = budget.init;
+        break;
+      case LOOP:
+        phase_budget = budget.loop;
+        break;
+      default:
+        phase_budget = budget.callback;
+        break;
+    }
+    phase_begin = std::chrono::nanoseconds(0); // the CPU clock is read lazily, see instruction_count_hook()
+    last_hook = phase_begin;
+    phase_overrun = false;
+
+    watch.wall_begin_ns.store(to_ns(std::chrono::steady_clock::now().time_since_epoch()), std::memory_order_relaxed);
+    watch.cpu_clock.store(this_thread_cpu_clock(), std::memory_order_relaxed);
+    watch.budget_ns.store(to_ns(phase_budget), std::memory_order_relaxed);
+    auto hard_limit = budget.mode == script_budget::HARD ? phase_budget : phase_budget * budget.hard_limit_factor;
+    watch.hard_limit_ns.store(to_ns(hard_limit), std::memory_order_relaxed);
+    watch.phase_seq.fetch_add(1, std::memory_order_release);
+  }
+
+  void lua_script::end_phase() {
+    phase = IDLE;
+    uint64_t seq = watch.phase_seq.fetch_add(1, std::memory_order_release);
+    if (watch.preempt_seq.load(std::memory_order_relaxed) == seq)
+      set_hook_count(hook_count); // remove the preemption hook, coroutines drop theirs on their next instruction
+  }
+
+  // one shot hook installed by the watchdog
+  static void preempt_hook(lua_State *L, lua_Debug *ar) {
+    auto p = this_lua_script(L);
+    if (p->watch.preempt_seq.load(std::memory_order_relaxed) == p->watch.phase_seq.load(std::memory_order_relaxed)) {
+      script_metrics::add(p->metrics.timeouts);
+      lua_getinfo(L, "Sl", ar); // Get source and line number
+      luaL_error(L, "timeout: at %s:%d", ar->short_src, ar->currentline);
+    }
+    // installed for a phase that already ended
+    lua_sethook(L, p->hook_count ? instruction_count_hook : nullptr, p->hook_count ? LUA_MASKCOUNT : 0, p->hook_count);
+  }
+
+  void lua_script::preempt(uint64_t seq) {
+    watch.preempt_seq.store(seq, std::memory_order_relaxed);
+    // lua_sethook is safe to call asynchronously, the threads notice it at their next instruction
+    std::lock_guard<std::mutex> lock(threads_mutex);
+    lua_sethook(L, preempt_hook, LUA_MASKCOUNT, 1);
+    for (auto co: running_threads)
+      lua_sethook(co, preempt_hook, LUA_MASKCOUNT, 1);
+  }
+
+  int lua_script::resume_tracked(lua_State *co, lua_State *from, int narg, int *nresults) {
+    {
+      std::lock_guard<std::mutex> lock(threads_mutex);
+      running_threads.push_back(co);
+    }
+    int status = lua_resume(co, from, narg, nresults);
+    std::lock_guard<std::mutex> lock(threads_mutex);
+    running_threads.pop_back();
+    return status;
+  }
+
+  void lua_script::event_publish(int eventid, const event_payload_ptr &payload) {
+    std::lock_guard<std::mutex> lock(queue_mutex);
+    event_queue.push(queued_event{eventid, payload});
+    wake_awaiting();
+  }
+
+  // pushes the payloads of a batch as an array, events published without a payload leave holes
+  static int push_batch(lua_State *L) {
+    auto &payloads = *static_cast<std::vector<event_payload_ptr> *>(lua_touserdata(L, 1));
+    lua_createtable(L, static_cast<int>(payloads.size()), 0);
+    for (size_t i = 0; i != payloads.size(); ++i) {
+      if (!payloads[i])
+        continue;
+      if (payloads[i]->push(L) != LUA_OK)
+        return lua_error(L);
+      lua_rawseti(L, -2, static_cast<lua_Integer>(i + 1));
+    }
+    return 1;
+  }
+
+  bool lua_script::call_event_handler(lua_Integer ref, int eventid, const event_payload_ptr &payload,
+                                      std::vector<event_payload_ptr> *batch, size_t count) {
+    lua_rawgeti(L, LUA_REGISTRYINDEX, ref); // Push the function onto the stack
+    lua_pushinteger(L, eventid); // Push the event ID as an argument
+    int nargs = 1;
+    if (batch) {
+      lua_pushcfunction(L, push_batch);
+      lua_pushlightuserdata(L, batch);
+      if (lua_pcall(L, 1, 1, 0) != LUA_OK)
+        return false;
+      nargs = 2;
+    } else if (payload) {
+      if (payload->push(L) != LUA_OK)
+        return false;
+      nargs = 2;
+    } else if (count) {
+      lua_pushnil(L);
+      nargs = 2;
+    }
+    if (count) {
+      lua_pushinteger(L, static_cast<lua_Integer>(count));
+      ++nargs;
+    }
+    auto t0 = std::chrono::steady_clock::now();
+    begin_phase(CALLBACK);
+    int status = lua_pcall(L, nargs, 0, 0);
+    end_phase();
+    if (status != 0)
+      return false;
+    metrics.callback_latency.record(std::chrono::steady_clock::now() - t0);
+    script_metrics::add(metrics.events_dispatched, count ? count : 1);
+    return true;
   }
 
   bool lua_script::handle_lua_callbacks() {
-    while (!event_queue.empty()) {
-      const int eventid = event_queue.front();
-      event_queue.pop();
+    std::queue<queued_event> events;
+    {
+      std::lock_guard<std::mutex> lock(queue_mutex);
+      events.swap(event_queue);
+    }
+    // BATCH and LATEST subscriptions are called once per event after the queue is drained, in order of the first
+    // occurrence
+    struct coalesced {
+      int id;
+      size_t count;
+      std::vector<event_payload_ptr> payloads; // all of them for BATCH, the latest for LATEST
+    };
+    std::vector<coalesced> coalesced_events;
+    while (!events.empty()) {
+      const int eventid = events.front().id;
+      event_payload_ptr payload = std::move(events.front().payload);
+      events.pop();
       // Iterate over subscribed scripts and call the corresponding Lua function
       auto item = event_handlers.find(eventid);
-      if (item != event_handlers.end()) {
-        lua_rawgeti(L, LUA_REGISTRYINDEX, item->second); // Push the function onto the stack
-        lua_pushinteger(L, eventid); // Push the event ID as an argument
-        if (lua_pcall(L, 1, 0, 0) != 0) { // Now expecting 1 argument
-          return false;
-        }
-      } else {
+      if (item == event_handlers.end()) {
         LOG(INFO) << "event but no callback... name:" << eventid;
+        continue;
+      }
+      auto coalesce = event_handler::EACH;
+      // by index and copied, a handler may subscribe again
+      for (size_t i = 0; i != item->second.size(); ++i) {
+        auto handler = item->second[i];
+        if (handler.mode != event_handler::EACH)
+          coalesce = handler.mode;
+        else if (!call_event_handler(handler.ref, eventid, payload))
+          return false;
+      }
+      if (coalesce == event_handler::EACH)
+        continue;
+      auto c = std::find_if(coalesced_events.begin(), coalesced_events.end(),
+                            [eventid](const coalesced &e) { return e.id == eventid; });
+      if (c == coalesced_events.end())
+        c = coalesced_events.insert(c, coalesced{eventid, 0, {}});
+      ++c->count;
+      if (coalesce == event_handler::LATEST)
+        c->payloads.clear();
+      c->payloads.push_back(std::move(payload));
+    }
+    for (auto &c: coalesced_events) {
+      // the handlers may have been replaced by an earlier callback of this tick
+      auto item = event_handlers.find(c.id);
+      if (item == event_handlers.end())
+        continue;
+      for (size_t i = 0; i != item->second.size(); ++i) {
+        auto handler = item->second[i];
+        bool ok = true;
+        if (handler.mode == event_handler::BATCH)
+          ok = call_event_handler(handler.ref, c.id, nullptr, &c.payloads, c.count);
+        else if (handler.mode == event_handler::LATEST)
+          ok = call_event_handler(handler.ref, c.id, c.payloads.back(), nullptr, c.count);
+        if (!ok)
+          return false;
       }
     }
 
     // Handling timer callbacks
-    auto it = elapsed_timers.begin();
-    while (it != elapsed_timers.end()) {
-      int timerId = *it;
-      auto timerItem = timer_handlers.find(timerId);
-      if (timerItem != timer_handlers.end()) {
-        lua_rawgeti(L, LUA_REGISTRYINDEX, timerItem->second); // Push the function onto the stack
-        lua_pushinteger(L, timerId); // Push the timer ID as an argument
-        if (lua_pcall(L, 1, 0, 0) != 0) { // Now expecting 1 argument
-          //it = elapsed_timers.erase(it);
-          return false;
+    std::vector<std::pair<int, lua_Integer>> callbacks;
+    {
+      std::lock_guard<std::mutex> lock(queue_mutex);
+      auto it = elapsed_timers.begin();
+      while (it != elapsed_timers.end()) {
+        auto timerItem = timer_handlers.find(*it);
+        if (timerItem != timer_handlers.end()) {
+          callbacks.emplace_back(*it, timerItem->second);
+          it = elapsed_timers.erase(it);
+        } else {
+          ++it; // Keep the timer in the list if there's no callback (polled with timer.is_elapsed)
         }
-        // Remove the timer from the list if the callback was successfully called
-        it = elapsed_timers.erase(it);
-      } else {
-        ++it; // Keep the timer in the list if there's no callback
       }
     }
+    for (auto &[timerId, funcRef]: callbacks) {
+      lua_rawgeti(L, LUA_REGISTRYINDEX, funcRef); // Push the function onto the stack
+      lua_pushinteger(L, timerId); // Push the timer ID as an argument
+      auto t0 = std::chrono::steady_clock::now();
+      begin_phase(CALLBACK);
+      int status = lua_pcall(L, 1, 0, 0);
+      end_phase();
+      if (status != 0) { // Now expecting 1 argument
+        return false;
+      }
+      metrics.callback_latency.record(std::chrono::steady_clock::now() - t0);
+      script_metrics::add(metrics.timers_dispatched);
+    }
     return true;
   }
 
   void lua_script::handle_timer_elapsed(int id) {
+    std::lock_guard<std::mutex> lock(queue_mutex);
     elapsed_timers.emplace_back(id);
+    wake_awaiting();
+  }
+
+  int lua_script::task_spawn(lua_State *co, int ref, int nargs) {
+    int id = next_task_id++;
+    tasks.emplace(id, lua_task{co, ref, nargs});
+    task_wake(id);
+    return id;
+  }
+
+  void lua_script::task_wake(int id) {
+    std::lock_guard<std::mutex> lock(queue_mutex);
+    runnable_tasks.push_back(id);
+  }
+
+  void lua_script::task_await(int id) {
+    std::lock_guard<std::mutex> lock(queue_mutex);
+    // something delivered while the condition was checked is handled next tick, check again after it
+    if (!event_queue.empty() || !elapsed_timers.empty())
+      runnable_tasks.push_back(id);
+    else
+      awaiting_tasks.push_back(id);
+  }
+
+  void lua_script::task_recheck(int id) {
+    std::lock_guard<std::mutex> lock(queue_mutex);
+    auto it = std::find(awaiting_tasks.begin(), awaiting_tasks.end(), id);
+    if (it == awaiting_tasks.end())
+      return; // already runnable
+    awaiting_tasks.erase(it);
+    runnable_tasks.push_back(id);
+  }
+
+  void lua_script::wake_awaiting() {
+    runnable_tasks.insert(runnable_tasks.end(), awaiting_tasks.begin(), awaiting_tasks.end());
+    awaiting_tasks.clear();
   }
 
   void executor::load_scripts(std::string script_dir) {
+    // sorted, the execution order does not depend on the file system
+    std::vector<fs::path> paths;
     for (const auto &entry: fs::directory_iterator(script_dir)) {
-      if (entry.path().extension() == ".lua") {
-        LOG(INFO) << "loading " << entry.path();
-        auto script = std::make_unique<lua_script>(this);
-        if (bind_lua_script_to_dataplane_)
-          bind_lua_script_to_dataplane_(script->L); // is this the right place to bind?
-        if (script->loadAndExecuteFile(entry.path().string())) {
-          scripts_.push_back(std::move(script));
+      if (entry.path().extension() == ".lua")
+        paths.push_back(entry.path());
+    }
+    std::sort(paths.begin(), paths.end());
+
+    // Each script has its own state, so creating, compiling and running the top level of the scripts can be spread
+    // over the worker threads; subscribing locks the shared registries, in whatever order the threads get there.
+    // Loaded scripts keep the order of paths.
+    std::vector<std::unique_ptr<lua_script>> loaded(paths.size());
+    auto load = [&](size_t ix) {
+      LOG(INFO) << "loading " << paths[ix];
+      try {
+        auto script = create_script(paths[ix].filename().string());
+        if (script->loadAndExecuteFile(paths[ix].string(), chunk_cache_.get())) {
+          loaded[ix] = std::move(script);
+        } else {
+          unsubscribe_all(script.get());
+          release_chunk(script->chunk_key);
         }
       }
+      catch (std::exception &e) {
+        LOG(ERROR) << "Failed to load " << paths[ix] << ": " << e.what();
+      }
+    };
+    {
+      LVM2_TRACE_SCOPE("load_scripts");
+      if (pool_ && paths.size() > 1) {
+        pool_->parallel_for(paths.size(), load);
+      } else {
+        for (size_t ix = 0; ix != paths.size(); ++ix)
+          load(ix);
+      }
+    }
+    for (auto &script: loaded) {
+      if (script)
+        scripts_.push_back(std::move(script));
     }
 
     // Run init function for each script
@@ -200,15 +516,15 @@ namespace lua_vm {
       auto &script = *it;
       if (script->initFunctionRef != LUA_NOREF) {
         lua_rawgeti(script->L, LUA_REGISTRYINDEX, script->initFunctionRef);
-        script->ts_begin_loop = std::chrono::high_resolution_clock::now();
-        if (lua_pcall(script->L, 0, 0, 0) != LUA_OK) {
+        script->begin_phase(lua_script::INIT);
+        int status = lua_pcall(script->L, 0, 0, 0);
+        script->end_phase();
+        if (status != LUA_OK) {
           LOG(ERROR) << "Error in init function: " << lua_tostring(script->L, -1)
                      << ", removing script from execution list";
           lua_pop(script->L, 1);
-
-          unsubscribe_all(script.get());
-          // Remove the script from the collection
-          it = scripts_.erase(it);
+          script_metrics::add(script->metrics.errors);
+          it = remove_failed_script(it);
           continue; // Skip the iterator increment
         }
       }
@@ -218,193 +534,715 @@ namespace lua_vm {
 
   bool executor::loadScriptFromFile(const std::string& script_path) {
     LOG(INFO) << "Loading " << script_path;
-    auto script = std::make_unique<lua_script>(this);
-    if (bind_lua_script_to_dataplane_)
-      bind_lua_script_to_dataplane_(script->L); // Bind the Lua script to the dataplane
-    if (script->loadAndExecuteFile(script_path)) {
+    auto script = create_script(fs::path(script_path).filename().string());
+    if (script->loadAndExecuteFile(script_path, chunk_cache_.get())) {
       scripts_.push_back(std::move(script));
       // Run init function for the loaded script
       auto& loaded_script = scripts_.back();
       if (loaded_script->initFunctionRef != LUA_NOREF) {
         lua_rawgeti(loaded_script->L, LUA_REGISTRYINDEX, loaded_script->initFunctionRef);
-        loaded_script->ts_begin_loop = std::chrono::high_resolution_clock::now();
-        if (lua_pcall(loaded_script->L, 0, 0, 0) != LUA_OK) {
+        loaded_script->begin_phase(lua_script::INIT);
+        int status = lua_pcall(loaded_script->L, 0, 0, 0);
+        loaded_script->end_phase();
+        if (status != LUA_OK) {
           LOG(ERROR) << "Error in init function: " << lua_tostring(loaded_script->L, -1)
                      << ", removing script from execution list";
           lua_pop(loaded_script->L, 1);
-          unsubscribe_all(loaded_script.get());
-          scripts_.pop_back(); // Remove the script from the list
+          script_metrics::add(loaded_script->metrics.errors);
+          remove_failed_script(std::prev(scripts_.end()));
           return false;
         }
         return true;
       }
     } else {
       LOG(ERROR) << "Failed to load and execute script from path: " << script_path;
+      release_chunk(script->chunk_key);
     }
     return false;
   }
 
-  bool executor::loadScriptFromBuffer(const std::string& script_buffer) {
-    auto script = std::make_unique<lua_script>(this);
-    if (bind_lua_script_to_dataplane_)
-      bind_lua_script_to_dataplane_(script->L); // Bind the Lua script to the dataplane
-    if (script->loadAndExecuteFromBuffer(script_buffer)) {
+  bool executor::loadScriptFromBuffer(const std::string& script_buffer, const std::string &name) {
+    auto script = create_script(name);
+    if (script->loadAndExecuteFromBuffer(script_buffer, chunk_cache_.get())) {
       scripts_.push_back(std::move(script));
       // Run init function for the loaded script
       auto& loaded_script = scripts_.back();
       if (loaded_script->initFunctionRef != LUA_NOREF) {
         lua_rawgeti(loaded_script->L, LUA_REGISTRYINDEX, loaded_script->initFunctionRef);
-        loaded_script->ts_begin_loop = std::chrono::high_resolution_clock::now();
-        if (lua_pcall(loaded_script->L, 0, 0, 0) != LUA_OK) {
+        loaded_script->begin_phase(lua_script::INIT);
+        int status = lua_pcall(loaded_script->L, 0, 0, 0);
+        loaded_script->end_phase();
+        if (status != LUA_OK) {
           LOG(ERROR) << "Error in init function: " << lua_tostring(loaded_script->L, -1)
                      << ", removing script from execution list";
           lua_pop(loaded_script->L, 1);
-          unsubscribe_all(loaded_script.get());
-          scripts_.pop_back(); // Remove the script from the list
+          script_metrics::add(loaded_script->metrics.errors);
+          remove_failed_script(std::prev(scripts_.end()));
           return false;
         }
         return true;
       }
     } else {
       LOG(ERROR) << "Failed to load and execute script from buffer";
+      release_chunk(script->chunk_key);
     }
     return false;
   }
 
 
 
+  std::unique_ptr<lua_script> executor::create_script(const std::string &name) {
+    lua_State *L = nullptr;
+    {
+      std::lock_guard<std::mutex> lock(state_pool_mutex_);
+      if (!state_pool_.empty()) {
+        L = state_pool_.back();
+        state_pool_.pop_back();
+      }
+    }
+    auto script = std::make_unique<lua_script>(this, L);
+    script->set_name(name);
+    auto budget = script_budgets_.find(name);
+    script->budget = (budget != script_budgets_.end()) ? budget->second : default_budget_;
+    if (script->allocator)
+      script->allocator->set_quota(script_memory_quota_);
+    if (watchdog_) {
+      script->watched_by = watchdog_.get();
+      watchdog_->watch(script.get());
+      script->set_hook_count(0);
+    }
+    if (profile_instruction_count_) {
+      script->profile = std::make_unique<lua_profile>();
+      script->profiling = true;
+      script->set_hook_count(profile_instruction_count_);
+    }
+    if (bind_lua_script_to_dataplane_)
+      bind_lua_script_to_dataplane_(script->L); // Bind the Lua script to the dataplane
+    return script;
+  }
+
+  void executor::prewarm_states(size_t n) {
+    std::vector<lua_State *> states;
+    states.reserve(n);
+    for (size_t i = 0; i != n; ++i)
+      states.push_back(new_lua_state());
+    std::lock_guard<std::mutex> lock(state_pool_mutex_);
+    state_pool_.insert(state_pool_.end(), states.begin(), states.end());
+  }
+
+  std::vector<script_allocator::stats> executor::get_memory_stats() const {
+    std::vector<script_allocator::stats> stats;
+    stats.reserve(scripts_.size());
+    for (auto &script: scripts_) {
+      if (script->allocator)
+        stats.push_back(script->allocator->get_stats());
+      else
+        stats.push_back(script_allocator::stats{(size_t) lua_gc(script->L, LUA_GCCOUNT) * 1024, 0, 0, 0, 0});
+    }
+    return stats;
+  }
+
+  void executor::set_chunk_cache_dir(const std::string &dir) {
+    auto cache = std::make_shared<chunk_cache>(dir);
+    std::lock_guard<std::mutex> lock(chunk_cache_mutex_);
+    chunk_cache_.swap(cache);
+  }
+
   void executor::run_loop() {
-    check_event_timers();
-    check_timers();
+    LVM2_TRACE_SCOPE("tick");
+    apply_reloads();
+    {
+      LVM2_TRACE_SCOPE("drain_inbox");
+      drain_inbox();
+    }
+    {
+      LVM2_TRACE_SCOPE("check_event_timers");
+      check_event_timers();
+    }
+    {
+      LVM2_TRACE_SCOPE("check_timers");
+      check_timers();
+    }
+    {
+      LVM2_TRACE_SCOPE("check_tasks");
+      check_tasks();
+    }
+    work_pending_ = false; // everything delivered so far is handled in this tick
+    total_ops_ += scripts_.size();
+
+    if (pool_) {
+      // scripts run concurrently, failed ones are removed afterwards in a serial pass
+      script_ok_.assign(scripts_.size(), 1);
+      pool_->parallel_for(scripts_.size(), [this](size_t ix) {
+        script_ok_[ix] = execute_script(scripts_[ix].get());
+      });
+      size_t ix = 0;
+      for (auto it = scripts_.begin(); it != scripts_.end(); ++ix) {
+        if (!script_ok_[ix]) {
+          it = remove_failed_script(it);
+        } else {
+          ++it;
+        }
+      }
+      dump_metrics_if_due();
+      return;
+    }
+
     for (auto it = scripts_.begin(); it != scripts_.end();) {
-      total_ops_++;
-      auto &script = *it;
+      if (!execute_script(it->get())) {
+        it = remove_failed_script(it);
+        continue; // Skip the iterator increment
+      }
+      ++it;
+    }
+    dump_metrics_if_due();
+  }
+
+  bool executor::execute_script(lua_script *script) {
+    LVM2_TRACE_SCOPE_DETAIL("script", script->trace_name);
+    if (script->budget.mode == script_budget::SOFT && std::chrono::steady_clock::now() < script->throttled_until) {
+      script_metrics::add(script->metrics.throttled_ticks);
+      return true;
+    }
 
-      // run callbacks before entering loop
-      if (!script->handle_lua_callbacks()) {
+    // run callbacks before entering loop
+    bool callbacks_ok;
+    {
+      LVM2_TRACE_SCOPE_DETAIL("handle_lua_callbacks", script->trace_name);
+      callbacks_ok = script->handle_lua_callbacks();
+    }
+    if (!callbacks_ok) {
+      LOG(ERROR) << "runtime error: " << lua_tostring(script->L, -1) << ", removing script from execution list";
+      lua_pop(script->L, 1);
+      script_metrics::add(script->metrics.errors);
+      return false;
+    }
+
+    bool tasks_ok;
+    {
+      LVM2_TRACE_SCOPE_DETAIL("run_tasks", script->trace_name);
+      tasks_ok = run_tasks(script);
+    }
+    if (!tasks_ok) {
+      LOG(ERROR) << "runtime error in task: " << lua_tostring(script->L, -1) << ", removing script from execution list";
+      lua_pop(script->L, 1);
+      script_metrics::add(script->metrics.errors);
+      return false;
+    }
+
+    if (script->loopFunctionRef != LUA_NOREF) {
+      lua_rawgeti(script->L, LUA_REGISTRYINDEX, script->loopFunctionRef);
+      script->ts_begin_loop = std::chrono::high_resolution_clock::now();
+      int status;
+      {
+        LVM2_TRACE_SCOPE_DETAIL("loop", script->trace_name);
+        script->begin_phase(lua_script::LOOP);
+        status = lua_pcall(script->L, 0, 0, 0);
+        script->end_phase();
+      }
+      if (status != LUA_OK) {
         LOG(ERROR) << "runtime error: " << lua_tostring(script->L, -1) << ", removing script from execution list";
         lua_pop(script->L, 1);
-        // Remove the script from the collection
-        unsubscribe_all(script.get());
-        it = scripts_.erase(it);
-        continue; // Skip the iterator increment
+        script_metrics::add(script->metrics.errors);
+        return false;
       }
+      auto end_ts = std::chrono::high_resolution_clock::now();
+      script->metrics.loop_latency.record(end_ts - script->ts_begin_loop);
+    }
+    script->metrics.heap_bytes.store(lua_gc(script->L, LUA_GCCOUNT) * 1024 + lua_gc(script->L, LUA_GCCOUNTB),
+                                     std::memory_order_relaxed);
 
-      if (script->loopFunctionRef != LUA_NOREF) {
-        lua_rawgeti(script->L, LUA_REGISTRYINDEX, script->loopFunctionRef);
-        script->ts_begin_loop = std::chrono::high_resolution_clock::now();
-        if (lua_pcall(script->L, 0, 0, 0) != LUA_OK) {
-          LOG(ERROR) << "runtime error: " << lua_tostring(script->L, -1) << ", removing script from execution list";
-          lua_pop(script->L, 1);
-          // Remove the script from the collection
-          unsubscribe_all(script.get());
-          it = scripts_.erase(it);
-          continue; // Skip the iterator increment
-        }
-        auto end_ts = std::chrono::high_resolution_clock::now();
-        auto duration = end_ts - script->ts_begin_loop;
-        // todo: add metrics to script...
-      }
-      ++it;
+    if (!script->tick_overrun) {
+      script->overrunning_ticks = 0;
+      return true;
+    }
+    script->tick_overrun = false;
+    script->throttled_until = std::chrono::steady_clock::now() + script->budget.throttle;
+    if (script->budget.evict_after && ++script->overrunning_ticks >= script->budget.evict_after) {
+      LOG(ERROR) << script->name << " ran over its budget in " << script->overrunning_ticks
+                 << " ticks in a row, removing script from execution list";
+      return false;
     }
+    return true;
   }
 
-  int64_t executor::get_total_ops() const { return total_ops_; }
+  std::vector<std::unique_ptr<lua_script>>::iterator executor::remove_failed_script(
+      std::vector<std::unique_ptr<lua_script>>::iterator it) {
+    auto &script = *it;
+    removed_scripts_.push_back(script->metrics.get_report(script->name));
+    LOG(INFO) << "final metrics " << removed_scripts_.back();
+    if (removed_scripts_.size() > max_removed_scripts)
+      removed_scripts_.pop_front();
+    unsubscribe_all(script.get());
+    uint64_t chunk_key = script->chunk_key;
+    auto next = scripts_.erase(it);
+    release_chunk(chunk_key);
+    return next;
+  }
 
-  int executor::event_open(std::string name) {
-    if (name == "") {
-      eventnames_.push_back("");
-      return eventnames_.size() - 1;
+  void executor::release_chunk(uint64_t key) {
+    if (!key)
+      return;
+    for (auto &script: scripts_) {
+      if (script->chunk_key == key)
+        return; // e.g. more instances of the same buffer
     }
-    for (size_t i = 0; i != eventnames_.size(); ++i) {
-      if (eventnames_[i] == name) {
-        return i;
-      }
+    chunk_cache_->release(key);
+  }
+
+  std::vector<script_metrics::report> executor::get_script_metrics() const {
+    std::vector<script_metrics::report> reports;
+    reports.reserve(scripts_.size());
+    for (auto &script: scripts_)
+      reports.push_back(script->metrics.get_report(script->name));
+    return reports;
+  }
+
+  void executor::start_profiling(int sample_every_instructions) {
+    if (sample_every_instructions <= 0)
+      throw std::invalid_argument("sample_every_instructions must be > 0");
+    profile_instruction_count_ = sample_every_instructions;
+    for (auto &script: scripts_) {
+      script->profile = std::make_unique<lua_profile>();
+      script->profiling = true;
+      script->set_hook_count(profile_instruction_count_);
     }
-    eventnames_.push_back(name);
-    return eventnames_.size() - 1;
   }
 
-  int executor::event_create_periodic(std::string event_name, std::chrono::milliseconds duration) {
-    // Find or insert the event name in the list and get its index
-    int ix = -1;
-    if (event_name.empty()) {
-      // Handle the case for an unnamed event, if applicable
-      ix = static_cast<int>(eventnames_.size());
-      eventnames_.push_back("");
-    } else {
-      auto it = std::find(eventnames_.begin(), eventnames_.end(), event_name);
-      if (it != eventnames_.end()) {
-        ix = static_cast<int>(std::distance(eventnames_.begin(), it));
-      } else {
-        ix = static_cast<int>(eventnames_.size());
-        eventnames_.push_back(event_name);
-      }
+  void executor::stop_profiling() {
+    profile_instruction_count_ = 0;
+    for (auto &script: scripts_) {
+      script->set_hook_count(watchdog_ ? 0 : hook_instruction_count);
+      script->profiling = false;
+    }
+  }
+
+  void executor::write_profile(std::ostream &os) const {
+    for (auto &script: scripts_) {
+      if (script->profile)
+        script->profile->write_folded(os, script->name);
+    }
+  }
+
+  void executor::enable_watchdog(std::chrono::microseconds period) {
+    if (watchdog_)
+      return;
+    watchdog_ = std::make_unique<watchdog>(period);
+    for (auto &script: scripts_) {
+      script->watched_by = watchdog_.get();
+      watchdog_->watch(script.get());
+      if (!script->profiling)
+        script->set_hook_count(0);
+    }
+  }
+
+  void executor::set_default_budget(const script_budget &budget) {
+    default_budget_ = budget;
+  }
+
+  void executor::set_script_budget(const std::string &name, const script_budget &budget) {
+    script_budgets_[name] = budget;
+    for (auto &script: scripts_) {
+      if (script->name == name)
+        script->budget = budget;
+    }
+  }
+
+  void executor::set_metrics_dump(std::chrono::milliseconds interval, metrics_sink sink) {
+    metrics_dump_interval_ = interval;
+    metrics_sink_ = std::move(sink);
+    next_metrics_dump_ = std::chrono::steady_clock::now() + interval;
+  }
+
+  void executor::dump_metrics_if_due() {
+    if (metrics_dump_interval_.count() == 0)
+      return;
+    auto now = std::chrono::steady_clock::now();
+    if (now < next_metrics_dump_)
+      return;
+    next_metrics_dump_ = now + metrics_dump_interval_;
+    auto reports = get_script_metrics();
+    if (metrics_sink_) {
+      metrics_sink_(reports);
+      return;
+    }
+    for (auto &r: reports)
+      LOG(INFO) << "metrics " << r;
+  }
+
+  void executor::run_forever(std::chrono::milliseconds max_interval) {
+    run_until(std::chrono::steady_clock::time_point::max(), max_interval);
+  }
+
+  void executor::run_until(std::chrono::steady_clock::time_point deadline, std::chrono::milliseconds max_interval) {
+    while (!stop_requested_) {
+      run_loop();
+
+      auto now = std::chrono::steady_clock::now();
+      if (now >= deadline)
+        break;
+      auto wake_at = std::min(deadline, next_deadline());
+      if (max_interval.count() > 0)
+        wake_at = std::min(wake_at, now + max_interval);
+
+      std::unique_lock<std::mutex> lock(wait_mutex_);
+      sleeping_ = true;
+      // StoreLoad barrier, pairs with the one in post_event(): the inbox is checked after sleeping_ is visible
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+      wait_cv_.wait_until(lock, wake_at, [this] {
+        return wake_pending_ || stop_requested_ || work_pending_ || !inbox_.empty();
+      });
+      sleeping_ = false;
+      wake_pending_ = false;
+    }
+    stop_requested_ = false;
+  }
+
+  void executor::stop() {
+    std::lock_guard<std::mutex> lock(wait_mutex_);
+    stop_requested_ = true;
+    wait_cv_.notify_all();
+  }
+
+  void executor::notify_change() {
+    change_epoch_.fetch_add(1, std::memory_order_release);
+    work_pending_ = true;
+    // StoreLoad barrier, as in post_event()
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (sleeping_.load())
+      wake();
+  }
+
+  void executor::wake() {
+    std::lock_guard<std::mutex> lock(wait_mutex_);
+    wake_pending_ = true;
+    wait_cv_.notify_all();
+  }
+
+  std::chrono::steady_clock::time_point executor::next_deadline() {
+    std::lock_guard<std::mutex> lock(registry_mutex_);
+    auto next = std::chrono::steady_clock::time_point::max();
+    if (!timer_queue_.empty())
+      next = std::min(next, timer_queue_.next_deadline());
+    if (!event_timer_queue_.empty())
+      next = std::min(next, event_timer_queue_.next_deadline());
+    if (!task_queue_.empty())
+      next = std::min(next, task_queue_.next_deadline());
+    return next;
+  }
+
+  void executor::set_worker_threads(size_t nr_of_threads) {
+    if (nr_of_threads > 1)
+      pool_ = std::make_unique<worker_pool>(nr_of_threads - 1);
+    else
+      pool_.reset();
+  }
+
+  int64_t executor::get_total_ops() const { return total_ops_; }
+
+  int executor::event_find_or_add(std::string_view name) {
+    if (!name.empty()) {
+      auto it = event_index_.find(name);
+      if (it != event_index_.end())
+        return it->second;
     }
+    int ix = static_cast<int>(eventnames_.size());
+    eventnames_.emplace_back(name);
+    if (!name.empty())
+      event_index_.emplace(name, ix);
+    return ix;
+  }
+
+  int executor::event_open(std::string_view name) {
+    std::lock_guard<std::mutex> lock(registry_mutex_);
+    return event_find_or_add(name);
+  }
+
+  int executor::event_create_periodic(std::string_view event_name, std::chrono::milliseconds duration) {
+    std::lock_guard<std::mutex> lock(registry_mutex_);
+    int ix = event_find_or_add(event_name);
 
     // Check if a periodic timer already exists for this event
     if (periodic_event_timers_.find(ix) != periodic_event_timers_.end()) {
       // todo Handle the error. throw an exception
       // For simplicity, let's just log an error and return -1.
-      throw std::logic_error("periodic event already defined: " + event_name);
+      throw std::logic_error("periodic event already defined: " + std::string(event_name));
       //throw timer_already_defined_exception(event_name);
       //LOG(ERROR) << "A periodic timer for event '" << event_name << "' already exists.";
       //return -1;
     }
 
     // Create and configure the periodic timer
-    auto new_timer = std::make_unique<timer>(event_name, timer::PERIODIC);
+    auto new_timer = std::make_unique<timer>(std::string(event_name), timer::PERIODIC);
     new_timer->elapse_after(duration);
 
     // Store the timer in the map
+    event_timer_queue_.push(new_timer->deadline(), ix, new_timer->generation());
     periodic_event_timers_[ix] = std::move(new_timer);
     return ix;
   }
 
 
+  std::optional<std::string> executor::event_name(lua_Integer eventid) {
+    std::lock_guard<std::mutex> lock(registry_mutex_);
+    if (eventid < 0 || eventid >= (lua_Integer) eventnames_.size())
+      return std::nullopt;
+    return eventnames_[eventid];
+  }
+
+  // Subscriber lists are short and walked on every publish, so they are plain vectors; the reverse index on the
+  // script keeps unsubscribing proportional to the script's own subscriptions.
+  static void subscribe(std::vector<std::vector<lua_script *>> &subscribers, int id, lua_script *script,
+                        std::vector<int> &subscribed) {
+    if (id < 0)
+      return;
+    if (static_cast<size_t>(id) >= subscribers.size())
+      subscribers.resize(id + 1);
+    auto &scripts = subscribers[id];
+    if (std::find(scripts.begin(), scripts.end(), script) != scripts.end())
+      return;
+    scripts.push_back(script);
+    subscribed.push_back(id);
+  }
+
+  static void unsubscribe(std::vector<std::vector<lua_script *>> &subscribers, int id, lua_script *script,
+                          std::vector<int> &subscribed) {
+    auto ix = std::find(subscribed.begin(), subscribed.end(), id);
+    if (ix == subscribed.end())
+      return;
+    *ix = subscribed.back();
+    subscribed.pop_back();
+    auto &scripts = subscribers[id];
+    scripts.erase(std::find(scripts.begin(), scripts.end(), script));
+  }
+
   void executor::add_event_subscription(int eventid, lua_script *script) {
-    event_subscribers_[eventid].insert(script);
+    std::lock_guard<std::mutex> lock(registry_mutex_);
+    subscribe(event_subscribers_, eventid, script, script->subscribed_events);
   }
 
   void executor::remove_event_unsubscription(int eventid, lua_script *script) {
-    auto it = event_subscribers_.find(eventid);
-    if (it != event_subscribers_.end()) {
-      it->second.erase(script);
+    std::lock_guard<std::mutex> lock(registry_mutex_);
+    unsubscribe(event_subscribers_, eventid, script, script->subscribed_events);
+  }
+
+  void executor::event_publish(int eventid, const event_payload_ptr &payload) {
+    std::lock_guard<std::mutex> lock(registry_mutex_);
+    event_deliver(eventid, payload);
+  }
+
+  void executor::post_event(int eventid, event_payload_ptr payload) {
+    inbox_.push(posted_event{eventid, std::move(payload)});
+    // StoreLoad barrier, pairs with the one in run_until(): without both fences the push and the store of sleeping_
+    // could each be missed by the other side's load, then the event waits for the next timeout
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (sleeping_.load())
+      wake();
+  }
+
+  void executor::enable_hot_reload(const std::string &script_dir) {
+    script_watcher_.reset();
+    script_watcher_ = std::make_unique<script_watcher>(script_dir, [this](auto &path, auto change) {
+      prepare_reload(path, change);
+    });
+  }
+
+  void executor::prepare_reload(const std::string &path, script_watcher::change_t change) {
+    auto name = fs::path(path).filename().string();
+    uint64_t chunk_key = 0;
+    if (change == script_watcher::CHANGED) {
+      // compile now, off the executor thread: syntax errors are found early and the swap finds the chunk cached
+      std::string source;
+      if (!read_script_source(path, source))
+        return; // removed again, its removal follows
+      std::shared_ptr<chunk_cache> cache;
+      {
+        std::lock_guard<std::mutex> lock(chunk_cache_mutex_);
+        cache = chunk_cache_;
+      }
+      chunk_key = chunk_cache::hash("@" + path, source);
+      lua_State *L = luaL_newstate();
+      int status = cache->load(L, source, "@" + path);
+      if (status != LUA_OK)
+        LOG(ERROR) << "Failed to reload " << path << ": " << lua_tostring(L, -1) << ", the running version is kept";
+      lua_close(L);
+      if (status != LUA_OK)
+        return;
     }
+    uint64_t superseded = 0;
+    {
+      std::lock_guard<std::mutex> lock(reload_mutex_);
+      auto it = std::find_if(pending_reloads_.begin(), pending_reloads_.end(),
+                             [&name](const pending_reload &r) { return r.name == name; });
+      if (it != pending_reloads_.end()) {
+        superseded = it->chunk_key;
+        *it = pending_reload{name, path, change, chunk_key};
+      } else {
+        pending_reloads_.push_back(pending_reload{name, path, change, chunk_key});
+      }
+      reloads_pending_ = true;
+    }
+    // a version saved over before it was swapped in is not needed anymore
+    if (superseded && superseded != chunk_key)
+      evict_chunk(superseded);
+    wake();
   }
 
-  void executor::event_publish(int eventid) {
-    auto it = event_subscribers_.find(eventid);
-    if (it != event_subscribers_.end()) {
-      for (lua_script *script: it->second) {
-        script->event_publish(eventid);
+  std::unique_ptr<lua_script> executor::reload_script(const std::string &name, const std::string &path) {
+    LOG(INFO) << "reloading " << path;
+    auto script = create_script(name);
+    if (!script->loadAndExecuteFile(path, chunk_cache_.get())) {
+      LOG(ERROR) << "Failed to reload " << path << ", the running version is kept";
+      unsubscribe_all(script.get());
+      return nullptr;
+    }
+    if (script->initFunctionRef != LUA_NOREF) {
+      lua_rawgeti(script->L, LUA_REGISTRYINDEX, script->initFunctionRef);
+      script->begin_phase(lua_script::INIT);
+      int status = lua_pcall(script->L, 0, 0, 0);
+      script->end_phase();
+      if (status != LUA_OK) {
+        LOG(ERROR) << "Error in init function of the new " << path << ": " << lua_tostring(script->L, -1)
+                   << ", the running version is kept";
+        lua_pop(script->L, 1);
+        unsubscribe_all(script.get());
+        return nullptr;
       }
     }
+    return script;
   }
 
-  int executor::timer_find_or_create_sharable(std::string name) {
-    for (size_t i = 0; i != timers_.size(); ++i) {
-      if (timers_[i].name() == name)
-        return i;
+  void executor::evict_chunk(uint64_t key) {
+    std::shared_ptr<chunk_cache> cache;
+    {
+      std::lock_guard<std::mutex> lock(chunk_cache_mutex_);
+      cache = chunk_cache_;
     }
-    timers_.emplace_back(timer(name));
-    return timers_.size() - 1;
+    if (key)
+      cache->evict(key);
+  }
+
+  void executor::apply_reloads() {
+    if (!reloads_pending_.load(std::memory_order_acquire))
+      return;
+    LVM2_TRACE_SCOPE("apply_reloads");
+    std::vector<pending_reload> reloads;
+    {
+      std::lock_guard<std::mutex> lock(reload_mutex_);
+      reloads.swap(pending_reloads_);
+      reloads_pending_ = false;
+    }
+    for (auto &reload: reloads) {
+      auto running = std::find_if(scripts_.begin(), scripts_.end(),
+                                  [&reload](const std::unique_ptr<lua_script> &s) { return s->name == reload.name; });
+      if (reload.change == script_watcher::REMOVED) {
+        if (running != scripts_.end()) {
+          LOG(INFO) << "removing " << reload.name;
+          evict_chunk((*running)->chunk_key);
+          unsubscribe_all(running->get());
+          scripts_.erase(running);
+          ++nr_of_reloads_;
+        }
+        continue;
+      }
+
+      // Events queued for the old version so far are handed over. Those queued while the new version runs its top
+      // level and init() were published by it, the new version got them itself if it subscribed in time.
+      size_t handed_over = 0;
+      if (running != scripts_.end()) {
+        std::lock_guard<std::mutex> lock((*running)->queue_mutex);
+        handed_over = (*running)->event_queue.size();
+      }
+      auto script = reload_script(reload.name, reload.path);
+      if (!script) {
+        if (running == scripts_.end() || (*running)->chunk_key != reload.chunk_key)
+          evict_chunk(reload.chunk_key);
+        continue;
+      }
+      if (script->chunk_key != reload.chunk_key)
+        evict_chunk(reload.chunk_key); // the file changed again since, its next reload is pending
+      if (running == scripts_.end()) {
+        scripts_.push_back(std::move(script));
+      } else {
+        // ids of named events and timers are the same for both versions
+        lua_script *old = running->get();
+        {
+          std::scoped_lock lock(old->queue_mutex, script->queue_mutex);
+          for (; handed_over != 0; --handed_over, old->event_queue.pop()) {
+            if (script->event_handlers.count(old->event_queue.front().id))
+              script->event_queue.push(std::move(old->event_queue.front()));
+          }
+          for (int timer_id: old->elapsed_timers) {
+            if (std::find(script->subscribed_timers.begin(), script->subscribed_timers.end(), timer_id) !=
+                script->subscribed_timers.end())
+              script->elapsed_timers.push_back(timer_id);
+          }
+        }
+        unsubscribe_all(old);
+        if (old->chunk_key != script->chunk_key)
+          evict_chunk(old->chunk_key);
+        *running = std::move(script); // keeps its place in the execution order
+      }
+      ++nr_of_reloads_;
+    }
+  }
+
+  void executor::drain_inbox() {
+    if (inbox_.empty())
+      return;
+    std::lock_guard<std::mutex> lock(registry_mutex_);
+    posted_event e;
+    while (inbox_.pop(e))
+      event_deliver(e.id, e.payload);
+  }
+
+  void executor::event_deliver(int eventid, const event_payload_ptr &payload) {
+    if (eventid < 0 || static_cast<size_t>(eventid) >= event_subscribers_.size())
+      return;
+    auto &scripts = event_subscribers_[eventid];
+    for (lua_script *script: scripts) {
+      script->event_publish(eventid, payload);
+    }
+    if (!scripts.empty())
+      work_pending_ = true;
+  }
+
+  int executor::timer_find_or_create_sharable(std::string_view name) {
+    std::lock_guard<std::mutex> lock(registry_mutex_);
+    auto it = timer_index_.find(name);
+    if (it != timer_index_.end())
+      return it->second;
+    int ix = static_cast<int>(timers_.size());
+    timers_.emplace_back(timer(std::string(name)));
+    timer_index_.emplace(name, ix);
+    return ix;
   }
 
   int executor::timer_create_private() {
+    std::lock_guard<std::mutex> lock(registry_mutex_);
     timers_.emplace_back(timer(""));
     return timers_.size() - 1;
   }
 
   void executor::add_timer_subscription(int timer_id, lua_script *script) {
-    timer_subscribers_[timer_id].insert(script);
+    std::lock_guard<std::mutex> lock(registry_mutex_);
+    subscribe(timer_subscribers_, timer_id, script, script->subscribed_timers);
   }
 
-  void executor::timer_unsubscribe(int timer_id, lua_script *script) {
-    auto it = timer_subscribers_.find(timer_id);
-    if (it != timer_subscribers_.end()) {
-      it->second.erase(script);
+  void executor::timer_schedule(int timer_id) {
+    // timers re-armed faster than they elapse leave stale entries behind, drop them once they dominate the queue
+    if (timer_queue_.size() > 2 * timers_.size() + 64) {
+      timer_queue_.remove_if([this](const deadline_queue<int>::entry &e) {
+        return timers_[e.key].generation() != e.generation;
+      });
     }
+    auto &t = timers_[timer_id];
+    timer_queue_.push(t.deadline(), timer_id, t.generation());
+  }
+
+  void executor::timer_unsubscribe(int timer_id, lua_script *script) {
+    std::lock_guard<std::mutex> lock(registry_mutex_);
+    unsubscribe(timer_subscribers_, timer_id, script, script->subscribed_timers);
   }
 
 /*void executor::timer_signal(int timer_id){
@@ -419,38 +1257,166 @@ namespace lua_vm {
 */
 
   void executor::unsubscribe_all(lua_script *script) {
-    for (auto &[eventName, scripts]: event_subscribers_) {
-      scripts.erase(script);
+    std::lock_guard<std::mutex> lock(registry_mutex_);
+    for (int eventid: script->subscribed_events) {
+      auto &scripts = event_subscribers_[eventid];
+      scripts.erase(std::find(scripts.begin(), scripts.end(), script));
+    }
+    script->subscribed_events.clear();
+
+    for (int timer_id: script->subscribed_timers) {
+      auto &scripts = timer_subscribers_[timer_id];
+      scripts.erase(std::find(scripts.begin(), scripts.end(), script));
     }
+    script->subscribed_timers.clear();
 
-    for (auto &[eventName, scripts]: timer_subscribers_) {
-      scripts.erase(script);
+    if (!script->tasks.empty()) {
+      task_queue_.remove_if([script](const deadline_queue<task_key>::entry &e) {
+        return e.key.script == script;
+      });
     }
   }
 
   void executor::check_event_timers() {
-    for (auto it = periodic_event_timers_.begin(); it != periodic_event_timers_.end(); ++it) {
-      if (it->second->elapsed()) {
-        event_publish(it->first);
+    std::lock_guard<std::mutex> lock(registry_mutex_);
+    if (event_timer_queue_.empty())
+      return;
+    auto now = std::chrono::steady_clock::now();
+    due_.clear();
+    event_timer_queue_.pop_due(now, due_);
+    for (auto &entry: due_) {
+      auto &t = *periodic_event_timers_[entry.key];
+      if (t.generation() == entry.generation && t.elapsed(now)) {
+        event_deliver(entry.key);
+        event_timer_queue_.push(t.deadline(), entry.key, t.generation());
       }
     }
   }
 
   void executor::check_timers() {
-    // Iterate through all timers
-    for (size_t i = 0; i < timers_.size(); ++i) {
-      // Check if the timer has elapsed
-      if (timers_[i].elapsed()) {
-        // Find all subscribers for this timer
-        auto subscribersIt = timer_subscribers_.find(static_cast<int>(i));
-        if (subscribersIt != timer_subscribers_.end()) {
-          // Call handle_timer_elapsed for each subscribed script
-          for (lua_script *script: subscribersIt->second) {
-            script->handle_timer_elapsed(static_cast<int>(i));
-          }
+    std::lock_guard<std::mutex> lock(registry_mutex_);
+    if (timer_queue_.empty())
+      return;
+    auto now = std::chrono::steady_clock::now();
+    due_.clear();
+    timer_queue_.pop_due(now, due_);
+    for (auto &entry: due_) {
+      auto &t = timers_[entry.key];
+      // stale entry - the timer was re-armed or stopped after it was queued
+      if (t.generation() != entry.generation || !t.elapsed(now))
+        continue;
+      if (t.is_running())
+        timer_queue_.push(t.deadline(), entry.key, t.generation()); // periodic
+      if (static_cast<size_t>(entry.key) >= timer_subscribers_.size())
+        continue;
+      // Call handle_timer_elapsed for each subscribed script
+      for (lua_script *script: timer_subscribers_[entry.key]) {
+        script->handle_timer_elapsed(entry.key);
+      }
+    }
+  }
+
+  void executor::check_tasks() {
+    std::lock_guard<std::mutex> lock(registry_mutex_);
+    if (task_queue_.empty())
+      return;
+    due_tasks_.clear();
+    task_queue_.pop_due(std::chrono::steady_clock::now(), due_tasks_);
+    for (auto &entry: due_tasks_) {
+      auto script = entry.key.script;
+      auto it = script->tasks.find(entry.key.task_id);
+      if (it == script->tasks.end() || it->second.generation != entry.generation)
+        continue; // finished or ran since it was queued
+      if (it->second.state == lua_task::AWAITING)
+        script->task_recheck(entry.key.task_id);
+      else
+        script->task_wake(entry.key.task_id);
+    }
+  }
+
+  void executor::task_park(lua_script *script, int task_id, const lua_task &task) {
+    std::lock_guard<std::mutex> lock(registry_mutex_);
+    task_queue_.push(task.wake_at, task_key{script, task_id}, task.generation);
+  }
+
+  void executor::await_park(lua_script *script, int task_id, lua_task &task) {
+    script->task_await(task_id);
+    task.wake_at = std::chrono::steady_clock::now() + await_poll_interval;
+    task_park(script, task_id, task);
+  }
+
+  bool executor::run_tasks(lua_script *script) {
+    std::vector<int> runnable;
+    uint64_t change_epoch = change_epoch_.load(std::memory_order_acquire);
+    {
+      std::lock_guard<std::mutex> lock(script->queue_mutex);
+      if (change_epoch != script->seen_change_epoch) {
+        script->seen_change_epoch = change_epoch;
+        script->wake_awaiting();
+      }
+      if (script->runnable_tasks.empty())
+        return true;
+      runnable.swap(script->runnable_tasks);
+    }
+
+    lua_State *L = script->L;
+    for (int id: runnable) {
+      auto it = script->tasks.find(id);
+      if (it == script->tasks.end())
+        continue;
+      auto &task = it->second;
+      ++task.generation;
+
+      if (task.state == lua_task::AWAITING && task.await_ref != LUA_NOREF) {
+        // evaluate the predicate on the main thread, the task itself is only resumed once it holds
+        lua_rawgeti(L, LUA_REGISTRYINDEX, task.await_ref);
+        script->begin_phase(lua_script::CALLBACK);
+        int status = lua_pcall(L, 0, 1, 0);
+        script->end_phase();
+        if (status != LUA_OK)
+          return false;
+        bool ready = lua_toboolean(L, -1);
+        lua_pop(L, 1);
+        if (!ready) {
+          await_park(script, id, task);
+          continue;
         }
+        luaL_unref(L, LUA_REGISTRYINDEX, task.await_ref);
+        task.await_ref = LUA_NOREF;
+      }
+
+      task.state = lua_task::RUNNABLE;
+      int nresults = 0;
+      script->running_task = &task;
+      auto t0 = std::chrono::steady_clock::now();
+      script->begin_phase(lua_script::CALLBACK);
+      int status = script->resume_tracked(task.co, L, task.nargs, &nresults);
+      script->end_phase();
+      script->metrics.callback_latency.record(std::chrono::steady_clock::now() - t0);
+      script_metrics::add(script->metrics.tasks_resumed);
+      script->running_task = nullptr;
+      task.nargs = 0;
+
+      if (status == LUA_YIELD) {
+        lua_pop(task.co, nresults);
+        if (task.state == lua_task::RUNNABLE) {
+          // plain coroutine.yield() - run again in the next tick, whatever makes it happen, a sleeping
+          // run_forever() is not kept awake for it
+          script->task_wake(id);
+        } else if (task.state == lua_task::AWAITING) {
+          await_park(script, id, task);
+        } else {
+          task_park(script, id, task);
+        }
+      } else if (status == LUA_OK) {
+        luaL_unref(L, LUA_REGISTRYINDEX, task.ref);
+        script->tasks.erase(it);
+      } else {
+        lua_xmove(task.co, L, 1); // error message
+        return false;
       }
     }
+    return true;
   }
 
   int executor::_lua_log(lua_State *L) {
@@ -518,8 +1484,9 @@ namespace lua_vm {
         return luaL_error(L, "Executor userdata not found");
       }
 
-      const char *eventName = luaL_checkstring(L, 1);
-      int id = exec->event_open(eventName);
+      size_t len = 0;
+      const char *eventName = luaL_checklstring(L, 1, &len);
+      int id = exec->event_open(std::string_view(eventName, len));
       lua_pushinteger(L, id);
       // Return number of results
       return 1;
@@ -536,9 +1503,10 @@ namespace lua_vm {
         return luaL_error(L, "Executor userdata not found");
       }
 
-      const char *eventName = luaL_checkstring(L, 1);
+      size_t len = 0;
+      const char *eventName = luaL_checklstring(L, 1, &len);
       auto duration = luaL_checkinteger(L, 2);
-      int id = exec->event_create_periodic(eventName, std::chrono::milliseconds(duration));
+      int id = exec->event_create_periodic(std::string_view(eventName, len), std::chrono::milliseconds(duration));
       // todo error handling - should this fail if already existing?? or just if the timer is wrong?
       lua_pushinteger(L, id);
       // Return number of results
@@ -568,18 +1536,24 @@ namespace lua_vm {
         return luaL_error(L, "Script userdata not found");
       }
 
-      // Make a reference to the Lua function
-      lua_pushvalue(L, 2); // Copy the function to the top of the stack
-      int funcRef = luaL_ref(L, LUA_REGISTRYINDEX); // Pops the function and returns a reference
-
-      // check valid event id
-      if (eventid < 0 || eventid >= (int) exec->eventnames_.size()) {
-        return luaL_error(L, "event %d not found", eventid);
+      // optional {batch=true} or {latest=true}
+      auto mode = lua_script::event_handler::EACH;
+      if (!lua_isnoneornil(L, 3)) {
+        luaL_checktype(L, 3, LUA_TTABLE);
+        lua_getfield(L, 3, "batch");
+        bool batch = lua_toboolean(L, -1);
+        lua_getfield(L, 3, "latest");
+        bool latest = lua_toboolean(L, -1);
+        lua_pop(L, 2);
+        if (batch && latest)
+          return luaL_error(L, "subscribe with batch or latest, not both");
+        if (batch)
+          mode = lua_script::event_handler::BATCH;
+        else if (latest)
+          mode = lua_script::event_handler::LATEST;
       }
 
-      // Store the function reference using the event name and the script instance
-      script->event_handlers[eventid] = funcRef;
-      exec->add_event_subscription(eventid, script);
+      event_subscribe(L, eventid, 2, mode, false);
       return 0;
     }
     catch (std::exception &e) {
@@ -587,13 +1561,66 @@ namespace lua_vm {
     }
   }
 
+  void executor::event_subscribe(lua_State *L, lua_Integer eventid, int fn_index,
+                                 lua_script::event_handler::mode_t mode, bool library) {
+    auto script = this_lua_script(L);
+    if (script == nullptr) {
+      luaL_error(L, "Script userdata not found");
+      return;
+    }
+    // check valid event id
+    if (!script->exec->event_name(eventid)) {
+      luaL_error(L, "event %d not found", (int) eventid);
+      return;
+    }
+
+    // Make a reference to the Lua function and store it for the event
+    lua_pushvalue(L, fn_index);
+    int funcRef = luaL_ref(L, LUA_REGISTRYINDEX); // Pops the function and returns a reference
+    lua_script::event_handler handler{funcRef, mode, library};
+    auto &handlers = script->event_handlers[eventid];
+    auto own = std::find_if(handlers.begin(), handlers.end(),
+                            [](const lua_script::event_handler &h) { return !h.library; });
+    if (!library && own != handlers.end()) {
+      luaL_unref(L, LUA_REGISTRYINDEX, (int) own->ref);
+      *own = handler;
+    } else {
+      handlers.push_back(handler);
+    }
+    script->exec->add_event_subscription(eventid, script);
+  }
+
+  int lua_event_open(lua_State *L, std::string_view name) {
+    auto exec = this_lua_executor(L);
+    if (exec == nullptr)
+      return luaL_error(L, "events need a script of an executor");
+    try {
+      return exec->event_open(name);
+    }
+    catch (std::exception &e) {
+      return luaL_error(L, "exception '%s'", e.what());
+    }
+  }
+
+  void lua_event_subscribe(lua_State *L, int eventid, int fn_index) {
+    try {
+      executor::event_subscribe(L, eventid, lua_absindex(L, fn_index), lua_script::event_handler::EACH, true);
+    }
+    catch (std::exception &e) {
+      luaL_error(L, "exception '%s'", e.what());
+    }
+  }
+
   int executor::_lua_event_publish(lua_State *L) {
     try {
       auto exec = this_lua_executor(L);
       if (exec == nullptr)
         return luaL_error(L, "exececutor userdata not found");
       int eventid = luaL_checkinteger(L, 1);
-      exec->event_publish(eventid);
+      event_payload_ptr payload;
+      if (!lua_isnoneornil(L, 2))
+        payload = event_payload::from_lua(L, 2);
+      exec->event_publish(eventid, payload);
       return 0;
     }
     catch (std::exception &e) {
@@ -607,9 +1634,10 @@ namespace lua_vm {
       if (exec == nullptr)
         return luaL_error(L, "exececutor userdata not found");
       int ix = luaL_checkinteger(L, 1);
-      if (ix < 0 || ix >= (int) exec->eventnames_.size())
+      auto name = exec->event_name(ix);
+      if (!name)
         return luaL_error(L, "event_id:  %d not found", ix);
-      lua_pushstring(L, exec->eventnames_[ix].c_str());
+      lua_pushstring(L, name->c_str());
       return 1;
     }
     catch (std::exception &e) {
@@ -673,10 +1701,9 @@ namespace lua_vm {
       // Check and fetch the argument from the Lua stack
       auto ix = luaL_checkinteger(L, 1);
       int64_t duration = luaL_checkinteger(L, 2);
-      if (ix < 0 || ix >= (int) exec->timers_.size()) {
+      if (!exec->with_timer(ix, [&](timer &t) { t.elapse_after(std::chrono::milliseconds(duration)); })) {
         return luaL_error(L, "timer %d not found", ix);
       }
-      exec->timers_[ix].elapse_after(std::chrono::milliseconds(duration));
       return 0;
     }
     catch (std::exception &e) {
@@ -691,10 +1718,9 @@ namespace lua_vm {
         return luaL_error(L, "exececutor userdata not found");
       // Check and fetch the argument from the Lua stack
       auto ix = luaL_checkinteger(L, 1);
-      if (ix < 0 || ix >= (int) exec->timers_.size()) {
+      if (!exec->with_timer(ix, [](timer &t) { t.stop(); })) {
         return luaL_error(L, "timer %d not found", ix);
       }
-      exec->timers_[ix].stop();
       return 0;
     }
     catch (std::exception &e) {
@@ -709,15 +1735,18 @@ namespace lua_vm {
         return luaL_error(L, "script userdata not found");
 
       auto id = luaL_checkinteger(L, 1);
-
-      auto it = std::find(script->elapsed_timers.begin(), script->elapsed_timers.end(), id);
-      if (it != script->elapsed_timers.end()) {
-        script->elapsed_timers.erase(it);
-        lua_pushboolean(L, true);
-        return 1;
+      bool elapsed = false;
+      {
+        // timer threads append to elapsed_timers through handle_timer_elapsed
+        std::lock_guard<std::mutex> lock(script->queue_mutex);
+        auto it = std::find(script->elapsed_timers.begin(), script->elapsed_timers.end(), id);
+        if (it != script->elapsed_timers.end()) {
+          script->elapsed_timers.erase(it);
+          elapsed = true;
+        }
       }
 
-      lua_pushboolean(L, false);
+      lua_pushboolean(L, elapsed);
       return 1;
     }
     catch (std::exception &e) {
@@ -732,10 +1761,11 @@ namespace lua_vm {
         return luaL_error(L, "exececutor userdata not found");
       // Check and fetch the argument from the Lua stack
       auto ix = luaL_checkinteger(L, 1);
-      if (ix < 0 || ix >= (int) exec->timers_.size()) {
+      bool active = false;
+      if (!exec->with_timer(ix, [&](timer &t) { active = t.is_active(); })) {
         return luaL_error(L, "timer %d not found", ix);
       }
-      lua_pushboolean(L, exec->timers_[ix].is_active());
+      lua_pushboolean(L, active);
       return 1;
     }
     catch (std::exception &e) {
@@ -750,10 +1780,11 @@ namespace lua_vm {
         return luaL_error(L, "exececutor userdata not found");
       // Check and fetch the argument from the Lua stack
       auto ix = luaL_checkinteger(L, 1);
-      if (ix < 0 || ix >= (int) exec->timers_.size()) {
+      std::chrono::milliseconds remaining(0);
+      if (!exec->with_timer(ix, [&](timer &t) { remaining = t.remaining(); })) {
         return luaL_error(L, "timer %d not found", ix);
       }
-      lua_pushinteger(L, exec->timers_[ix].remaining().count());
+      lua_pushinteger(L, remaining.count());
       return 1;
     }
     catch (std::exception &e) {
@@ -767,9 +1798,9 @@ namespace lua_vm {
       if (exec == nullptr)
         return luaL_error(L, "exececutor userdata not found");
       int ix = luaL_checkinteger(L, 1);
-      if (ix < 0 || ix >= (int) exec->timers_.size())
+      std::string name;
+      if (!exec->with_timer(ix, [&](timer &t) { name = t.name(); }))
         return luaL_error(L, "timer id:  %d not found", ix);
-      std::string name = exec->timers_[ix].name();
       if (!name.size())
         name = "<noname>";
       lua_pushstring(L, name.c_str());
@@ -785,20 +1816,222 @@ namespace lua_vm {
     return 1;
   }
 
-  static int sleep_wakeup(lua_State* L, int status, lua_KContext ctx) {
-    int64_t end_time = lua_tointeger(L, lua_upvalueindex(1));
-    if (end_time > now()) {
-      return lua_yieldk(L, 0, ctx, sleep_wakeup); // Note: Using lua_yieldk correctly
+  int executor::_lua_task_spawn(lua_State *L) {
+    try {
+      auto script = this_lua_script(L);
+      if (script == nullptr)
+        return luaL_error(L, "script userdata not found");
+
+      int nargs = lua_gettop(L) - 1;
+      lua_State *co = nullptr;
+      if (lua_type(L, 1) == LUA_TTHREAD) {
+        co = lua_tothread(L, 1);
+        lua_pushvalue(L, 1);
+      } else {
+        luaL_checktype(L, 1, LUA_TFUNCTION);
+        co = lua_newthread(L);
+        lua_pushvalue(L, 1);
+        lua_xmove(L, co, 1); // the function becomes the body of the new thread
+      }
+      int ref = luaL_ref(L, LUA_REGISTRYINDEX); // Pops the thread and returns a reference
+
+      // the remaining arguments are passed to the first resume
+      for (int i = 2; i <= nargs + 1; ++i)
+        lua_pushvalue(L, i);
+      lua_xmove(L, co, nargs);
+
+      int id = script->task_spawn(co, ref, nargs);
+      this_lua_executor(L)->work_pending_ = true;
+      lua_pushinteger(L, id);
+      return 1;
+    }
+    catch (std::exception &e) {
+      return luaL_error(L, "exception '%s'", e.what());
+    }
+  }
+
+  // returns the task if L is the thread of the task the executor is currently resuming
+  static inline lua_task *this_lua_task(lua_State *L) {
+    auto task = this_lua_script(L)->running_task;
+    return (task && task->co == L) ? task : nullptr;
+  }
+
+  // Continuations used outside the scheduler, e.g. in a coroutine resumed from loop(): every resume before the
+  // deadline in ctx just yields again.
+  static int sleep_continuation(lua_State *L, int status, lua_KContext ctx) {
+    if (now() < (int64_t) ctx)
+      return lua_yieldk(L, 0, ctx, sleep_continuation);
+    return 0;
+  }
+
+  static int await_value_continuation(lua_State *L, int status, lua_KContext ctx) {
+    if (now() < (int64_t) ctx)
+      return lua_yieldk(L, 0, ctx, await_value_continuation);
+    lua_settop(L, 1);
+    return 1;
+  }
+
+  static int await_predicate_continuation(lua_State *L, int status, lua_KContext ctx) {
+    if (now() < (int64_t) ctx)
+      return lua_yieldk(L, 0, ctx, await_predicate_continuation);
+    lua_settop(L, 1);
+    lua_pushvalue(L, 1);
+    lua_call(L, 0, 1);
+    if (lua_toboolean(L, -1))
+      return 1;
+    lua_pop(L, 1);
+    lua_KContext deadline = now() + await_poll_interval.count();
+    return lua_yieldk(L, 0, deadline, await_predicate_continuation);
+  }
+
+  // Continuations used when the executor resumes a parked task
+  static int task_await_value_continuation(lua_State *L, int status, lua_KContext ctx) {
+    lua_settop(L, 1);
+    return 1;
+  }
+
+  static int task_await_predicate_continuation(lua_State *L, int status, lua_KContext ctx) {
+    lua_pushboolean(L, true);
+    return 1;
+  }
+
+  int executor::_lua_asleep(lua_State *L) {
+    auto milliseconds = luaL_checkinteger(L, 1);
+    if (auto task = this_lua_task(L)) {
+      task->state = lua_task::SLEEPING;
+      task->wake_at = std::chrono::steady_clock::now() + std::chrono::milliseconds(milliseconds);
+      return lua_yield(L, 0);
+    }
+    return lua_yieldk(L, 0, now() + milliseconds, sleep_continuation);
+  }
+
+  int executor::_lua_await(lua_State *L) {
+    luaL_checkany(L, 1);
+    lua_settop(L, 1);
+    auto task = this_lua_task(L);
+
+    if (lua_isfunction(L, 1)) {
+      lua_pushvalue(L, 1);
+      lua_call(L, 0, 1);
+      if (lua_toboolean(L, -1))
+        return 1;
+      lua_pop(L, 1);
+      if (task) {
+        lua_pushvalue(L, 1);
+        task->await_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+        task->state = lua_task::AWAITING;
+        return lua_yieldk(L, 0, 0, task_await_predicate_continuation);
+      }
+      return lua_yieldk(L, 0, now() + await_poll_interval.count(), await_predicate_continuation);
+    }
+
+    if (lua_toboolean(L, 1))
+      return 1;
+    if (task) {
+      // a value cannot be checked again, the task resumes with it once something changed and reads it anew
+      task->state = lua_task::AWAITING;
+      return lua_yieldk(L, 0, 0, task_await_value_continuation);
+    }
+    return lua_yieldk(L, 0, now() + await_poll_interval.count(), await_value_continuation);
+  }
+
+  // As auxresume in lcorolib.c, but through lua_script::resume_tracked() so the watchdog can preempt co. Returns
+  // the number of results moved to L, or -1 with the error message on L.
+  static int aux_resume(lua_State *L, lua_State *co, int narg) {
+    if (!lua_checkstack(co, narg)) {
+      lua_pushliteral(L, "too many arguments to resume");
+      return -1;
+    }
+    lua_xmove(L, co, narg);
+    int nres = 0;
+    auto script = this_lua_script(L);
+    int status = script ? script->resume_tracked(co, L, narg, &nres) : lua_resume(co, L, narg, &nres);
+    if (status == LUA_OK || status == LUA_YIELD) {
+      if (!lua_checkstack(L, nres + 1)) {
+        lua_pop(co, nres);
+        lua_pushliteral(L, "too many results to resume");
+        return -1;
+      }
+      lua_xmove(co, L, nres);
+      return nres;
     }
+    lua_xmove(co, L, 1);
+    return -1;
+  }
+
+  int executor::_lua_coroutine_resume(lua_State *L) {
+    lua_State *co = lua_tothread(L, 1);
+    luaL_argexpected(L, co, 1, "coroutine");
+    int r = aux_resume(L, co, lua_gettop(L) - 1);
+    if (r < 0) {
+      lua_pushboolean(L, 0);
+      lua_insert(L, -2);
+      return 2; // false + error message
+    }
+    lua_pushboolean(L, 1);
+    lua_insert(L, -(r + 1));
+    return r + 1;
+  }
+
+  static int aux_wrap(lua_State *L) {
+    lua_State *co = lua_tothread(L, lua_upvalueindex(1));
+    int r = aux_resume(L, co, lua_gettop(L));
+    if (r < 0) {
+      int status = lua_status(co);
+      if (status != LUA_OK && status != LUA_YIELD) { // error in the coroutine
+#if LUA_VERSION_RELEASE_NUM >= 50406
+        status = lua_closethread(co, L);
+#else
+        status = lua_resetthread(co);
+#endif
+        lua_xmove(co, L, 1);
+      }
+      if (status != LUA_ERRMEM && lua_type(L, -1) == LUA_TSTRING) {
+        luaL_where(L, 1);
+        lua_insert(L, -2);
+        lua_concat(L, 2);
+      }
+      return lua_error(L);
+    }
+    return r;
+  }
+
+  int executor::_lua_coroutine_wrap(lua_State *L) {
+    luaL_checktype(L, 1, LUA_TFUNCTION);
+    lua_State *co = lua_newthread(L);
+    lua_pushvalue(L, 1);
+    lua_xmove(L, co, 1);
+    lua_pushcclosure(L, aux_wrap, 1);
+    return 1;
+  }
+
+  static int panic_handler(lua_State *L) {
+    const char *msg = lua_tostring(L, -1);
+    LOG(FATAL) << "unprotected error in call to Lua API: " << (msg ? msg : "error object is not a string");
     return 0;
   }
 
-  static int coroutine_sleep(lua_State* L) {
-    // First argument is the number of milliseconds to sleep
-    int milliseconds = luaL_checkinteger(L, 1);
-    auto end_time  = now() + milliseconds;
-    lua_pushinteger(L, end_time);
-    return lua_yieldk(L, 0, 0, sleep_wakeup); // Passing sleep_wakeup as the continuation function
+  lua_State *executor::new_lua_state() {
+    auto allocator = new script_allocator();
+    lua_State *L = lua_newstate(script_allocator::lua_alloc, allocator);
+    if (L == nullptr) {
+      delete allocator;
+      throw std::bad_alloc();
+    }
+    lua_atpanic(L, panic_handler);
+    set_state_object<lua_script>(L, nullptr);
+    //luaL_openlibs(L);
+    lua_load_libraries(L);
+    lua_register_event_functions(L);
+    return L;
+  }
+
+  void executor::close_lua_state(lua_State *L) {
+    void *ud = nullptr;
+    bool own_allocator = lua_getallocf(L, &ud) == script_allocator::lua_alloc;
+    lua_close(L);
+    if (own_allocator)
+      delete static_cast<script_allocator *>(ud);
   }
 
   void  executor::lua_load_libraries(lua_State *L){
@@ -865,9 +2098,25 @@ namespace lua_vm {
     luaL_newlib(L, timer_funcs);
     lua_setglobal(L, "timer");
 
+    luaL_Reg task_funcs[] = {
+        {"spawn", _lua_task_spawn},
+        {NULL, NULL} // Sentinel to indicate the end of the array
+    };
+    luaL_newlib(L, task_funcs);
+    lua_setglobal(L, "task");
+
     lua_register(L, "now", _lua_now);
-    lua_register(L, "sleep2", coroutine_sleep);
-    //lua_pushcfunction(L, coroutine_sleep);
-    //lua_setglobal(L, "sleep");
+    lua_register(L, "asleep", _lua_asleep);
+    lua_register(L, "await", _lua_await);
+
+    // coroutines resumed from Lua must be known to the watchdog
+    lua_getglobal(L, LUA_COLIBNAME);
+    if (lua_istable(L, -1)) {
+      lua_pushcfunction(L, _lua_coroutine_resume);
+      lua_setfield(L, -2, "resume");
+      lua_pushcfunction(L, _lua_coroutine_wrap);
+      lua_setfield(L, -2, "wrap");
+    }
+    lua_pop(L, 1);
   }
 }
\ No newline at end of file
@@ -0,0 +1,67 @@
+#include <lvm2/lua_profiler.h>
+
+namespace lua_vm {
+  // "function (source:line)", without the separators of the folded format
+  static void append_frame(std::string &stack, lua_State *L, lua_Debug &ar) {
+    lua_getinfo(L, "Sn", &ar);
+    const char *name = ar.name;
+    if (name == nullptr)
+      name = (*ar.what == 'm') ? "main chunk" : "?";
+    size_t from = stack.size();
+    stack += name;
+    if (*ar.what == 'C') {
+      stack += " [C]";
+    } else {
+      stack += " (";
+      stack += ar.short_src;
+      stack += ':';
+      stack += std::to_string(ar.linedefined);
+      stack += ')';
+    }
+    for (size_t i = from; i != stack.size(); ++i) {
+      if (stack[i] == ';' || stack[i] == '\n')
+        stack[i] = ':';
+    }
+  }
+
+  void lua_profile::sample(lua_State *L) {
+    // getstack walks from the innermost frame, folded stacks start at the root
+    lua_Debug frames[max_depth];
+    int depth = 0;
+    while (depth != max_depth && lua_getstack(L, depth, &frames[depth]))
+      ++depth;
+
+    std::string stack;
+    for (int i = depth - 1; i >= 0; --i) {
+      if (!stack.empty())
+        stack += ';';
+      append_frame(stack, L, frames[i]);
+    }
+    if (stack.empty())
+      return;
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    ++stacks_[stack];
+    ++samples_;
+  }
+
+  void lua_profile::write_folded(std::ostream &os, const std::string &prefix) const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (auto &[stack, count]: stacks_) {
+      if (!prefix.empty())
+        os << prefix << ';';
+      os << stack << ' ' << count << '\n';
+    }
+  }
+
+  uint64_t lua_profile::nr_of_samples() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return samples_;
+  }
+
+  void lua_profile::clear() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stacks_.clear();
+    samples_ = 0;
+  }
+} // namespace lua_vm
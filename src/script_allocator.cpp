@@ -0,0 +1,121 @@
+#include <lvm2/script_allocator.h>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+
+namespace lua_vm {
+  script_allocator::script_allocator(size_t quota)
+      : quota_(quota) {
+  }
+
+  script_allocator::~script_allocator() {
+    for (auto arena: arenas_)
+      free(arena);
+  }
+
+  script_allocator::stats script_allocator::get_stats() const {
+    return stats{bytes_in_use_.load(std::memory_order_relaxed),
+                 peak_bytes_.load(std::memory_order_relaxed),
+                 allocations_.load(std::memory_order_relaxed),
+                 failed_allocations_.load(std::memory_order_relaxed),
+                 quota_.load(std::memory_order_relaxed)};
+  }
+
+  void *script_allocator::lua_alloc(void *ud, void *ptr, size_t osize, size_t nsize) {
+    auto self = static_cast<script_allocator *>(ud);
+    // if ptr is NULL osize encodes the kind of object, not a size
+    size_t old_size = ptr ? osize : 0;
+
+    if (nsize == 0) {
+      if (ptr) {
+        self->deallocate(ptr, old_size);
+        self->bytes_in_use_.fetch_sub(old_size, std::memory_order_relaxed);
+      }
+      return nullptr;
+    }
+
+    const size_t in_use = self->bytes_in_use_.load(std::memory_order_relaxed);
+    const size_t quota = self->quota_.load(std::memory_order_relaxed);
+    if (quota && nsize > old_size && in_use + (nsize - old_size) > quota) {
+      self->failed_allocations_.fetch_add(1, std::memory_order_relaxed);
+      return nullptr; // Lua turns this into a memory error in the script
+    }
+
+    void *p = ptr ? self->reallocate(ptr, old_size, nsize) : self->allocate(nsize);
+    if (!p) {
+      self->failed_allocations_.fetch_add(1, std::memory_order_relaxed);
+      return nullptr;
+    }
+
+    const size_t now_in_use = in_use - old_size + nsize;
+    self->bytes_in_use_.store(now_in_use, std::memory_order_relaxed);
+    if (now_in_use > self->peak_bytes_.load(std::memory_order_relaxed))
+      self->peak_bytes_.store(now_in_use, std::memory_order_relaxed);
+    self->allocations_.fetch_add(1, std::memory_order_relaxed);
+    return p;
+  }
+
+  void *script_allocator::allocate(size_t size) {
+    if (size > max_small_size)
+      return malloc(size);
+
+    const size_t cls = class_of(size);
+    if (auto block = free_lists_[cls]) {
+      free_lists_[cls] = block->next;
+      return block;
+    }
+
+    const size_t block_size = (cls + 1) * granularity;
+    if (bump_ + block_size > bump_end_) {
+      // the tail of the previous arena is left unused, it is smaller than the largest class
+      auto arena = static_cast<char *>(malloc(arena_size));
+      if (!arena)
+        return nullptr;
+      arenas_.push_back(arena);
+      bump_ = arena;
+      bump_end_ = arena + arena_size;
+    }
+    void *p = bump_;
+    bump_ += block_size;
+    return p;
+  }
+
+  void script_allocator::deallocate(void *ptr, size_t size) {
+    if (size > max_small_size) {
+      free(ptr);
+      return;
+    }
+    auto block = static_cast<free_block *>(ptr);
+    const size_t cls = class_of(size);
+    block->next = free_lists_[cls];
+    free_lists_[cls] = block;
+  }
+
+  void *script_allocator::reallocate(void *ptr, size_t osize, size_t nsize) {
+    if (osize > max_small_size && nsize > max_small_size) {
+      void *p = realloc(ptr, nsize);
+      return p || nsize > osize ? p : ptr;
+    }
+    if (osize <= max_small_size && nsize <= max_small_size && class_of(osize) == class_of(nsize))
+      return ptr;
+
+    void *p = allocate(nsize);
+    if (!p) {
+      if (nsize > osize)
+        return nullptr;
+      // Lua requires shrinking to succeed, the block is kept. A malloc()ed one is handled as a small block from
+      // now on, it is freed with the arenas.
+      if (osize > max_small_size) {
+        try {
+          arenas_.push_back(ptr);
+        } catch (std::bad_alloc &) {
+          // leaked, but still valid
+        }
+      }
+      return ptr;
+    }
+    memcpy(p, ptr, osize < nsize ? osize : nsize);
+    deallocate(ptr, osize);
+    return p;
+  }
+} // namespace lua_vm
@@ -0,0 +1,31 @@
+#include <lvm2/script_metrics.h>
+
+namespace lua_vm {
+  script_metrics::report script_metrics::get_report(const std::string &name) const {
+    return report{name,
+                  loop_latency.summarize(),
+                  callback_latency.summarize(),
+                  events_dispatched.load(std::memory_order_relaxed),
+                  timers_dispatched.load(std::memory_order_relaxed),
+                  tasks_resumed.load(std::memory_order_relaxed),
+                  errors.load(std::memory_order_relaxed),
+                  budget_overruns.load(std::memory_order_relaxed),
+                  timeouts.load(std::memory_order_relaxed),
+                  throttled_ticks.load(std::memory_order_relaxed),
+                  instructions.load(std::memory_order_relaxed),
+                  heap_bytes.load(std::memory_order_relaxed)};
+  }
+
+  static std::ostream &operator<<(std::ostream &os, const latency_histogram::summary &s) {
+    return os << s.count << " p50=" << s.p50.count() / 1000.0 << "us p99=" << s.p99.count() / 1000.0
+              << "us max=" << s.max.count() / 1000.0 << "us";
+  }
+
+  std::ostream &operator<<(std::ostream &os, const script_metrics::report &r) {
+    return os << r.name << ": loops=" << r.loop_latency << ", callbacks=" << r.callback_latency
+              << ", events=" << r.events_dispatched << ", timers=" << r.timers_dispatched
+              << ", tasks=" << r.tasks_resumed  << ", errors=" << r.errors << ", overruns=" << r.budget_overruns
+              << ", timeouts=" << r.timeouts << ", throttled=" << r.throttled_ticks << ", instructions=" << r.instructions
+              << ", heap=" << r.heap_bytes;
+  }
+} // namespace lua_vm
@@ -0,0 +1,76 @@
+#include <lvm2/script_watcher.h>
+#include <lvm2/trace.h>
+#include <cerrno>
+#include <cstdint>
+#include <filesystem>
+#include <system_error>
+#include <glog/logging.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+
+namespace fs = std::filesystem;
+
+namespace lua_vm {
+  script_watcher::script_watcher(const std::string &dir, callback_fn on_change)
+      : dir_(dir), on_change_(std::move(on_change)) {
+    inotify_fd_ = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (inotify_fd_ < 0)
+      throw std::system_error(errno, std::generic_category(), "inotify_init1");
+    if (inotify_add_watch(inotify_fd_, dir_.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_DELETE) < 0) {
+      int error = errno;
+      close(inotify_fd_);
+      throw std::system_error(error, std::generic_category(), "watching " + dir_);
+    }
+    stop_fd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (stop_fd_ < 0) {
+      int error = errno;
+      close(inotify_fd_);
+      throw std::system_error(error, std::generic_category(), "eventfd");
+    }
+    thread_ = std::thread(&script_watcher::run, this);
+  }
+
+  script_watcher::~script_watcher() {
+    uint64_t one = 1;
+    if (write(stop_fd_, &one, sizeof(one)) != sizeof(one))
+      LOG(ERROR) << "cannot stop the script watcher of " << dir_;
+    thread_.join();
+    close(stop_fd_);
+    close(inotify_fd_);
+  }
+
+  void script_watcher::run() {
+#ifdef LVM2_ENABLE_TRACING
+    tracer::set_thread_name("lvm2 script watcher");
+#endif
+    alignas(inotify_event) char buffer[4096];
+    pollfd fds[2] = {{inotify_fd_, POLLIN, 0}, {stop_fd_, POLLIN, 0}};
+    for (;;) {
+      if (poll(fds, 2, -1) < 0) {
+        if (errno == EINTR)
+          continue;
+        LOG(ERROR) << "script watcher of " << dir_ << " stopped: " << std::error_code(errno, std::generic_category());
+        return;
+      }
+      if (fds[1].revents)
+        return;
+      ssize_t n = read(inotify_fd_, buffer, sizeof(buffer));
+      if (n <= 0)
+        continue;
+      for (char *p = buffer; p < buffer + n;) {
+        auto event = reinterpret_cast<const inotify_event *>(p);
+        p += sizeof(inotify_event) + event->len;
+        if (event->mask & IN_Q_OVERFLOW)
+          LOG(WARNING) << "script watcher of " << dir_ << " missed changes, rewrite the scripts to reload them";
+        if (event->len == 0)
+          continue;
+        fs::path path = fs::path(dir_) / event->name;
+        if (path.extension() != ".lua")
+          continue;
+        on_change_(path.string(), (event->mask & (IN_DELETE | IN_MOVED_FROM)) ? REMOVED : CHANGED);
+      }
+    }
+  }
+} // namespace lua_vm
@@ -0,0 +1,219 @@
+#include <lvm2/trace.h>
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <unordered_set>
+#include <vector>
+
+namespace lua_vm {
+  namespace {
+    struct span {
+      const char *name;
+      const char *detail;
+      uint64_t begin_ns;
+      uint64_t end_ns;
+    };
+
+    // written only by its thread, read by write_chrome_json()
+    struct thread_buffer {
+      std::vector<span> ring;               // allocated by the first span, so untraced threads cost no ring
+      std::atomic<uint64_t> head = 0;       // number of spans recorded since generation started
+      std::atomic<uint64_t> generation = 0; // tracer run the spans belong to
+      uint32_t tid = 0;
+      std::string thread_name;              // guarded by registry::mutex
+      bool exited = false;                  // guarded by registry::mutex, dropped once its spans are written
+    };
+
+    struct registry {
+      std::mutex mutex;
+      std::vector<std::shared_ptr<thread_buffer>> buffers;
+      std::unordered_set<std::string> interned;
+      std::atomic<uint64_t> generation = 0;
+      uint32_t next_tid = 1;
+
+      // with mutex held
+      void drop_exited() {
+        std::erase_if(buffers, [](const std::shared_ptr<thread_buffer> &b) { return b->exited; });
+      }
+    };
+
+    registry &the_registry() {
+      static registry r;
+      return r;
+    }
+
+    // registers the buffer of its thread and hands it back to the registry when the thread exits
+    struct thread_buffer_owner {
+      std::shared_ptr<thread_buffer> buffer = std::make_shared<thread_buffer>();
+
+      thread_buffer_owner() {
+        auto &r = the_registry();
+        std::lock_guard<std::mutex> lock(r.mutex);
+        buffer->tid = r.next_tid++;
+        r.buffers.push_back(buffer);
+      }
+
+      ~thread_buffer_owner() {
+        auto &r = the_registry();
+        std::lock_guard<std::mutex> lock(r.mutex);
+        buffer->exited = true;
+        // kept for write_chrome_json() only if it holds spans of the current run
+        if (buffer->ring.empty() ||
+            buffer->generation.load(std::memory_order_relaxed) != r.generation.load(std::memory_order_relaxed))
+          std::erase(r.buffers, buffer);
+      }
+    };
+
+    thread_buffer &this_thread_buffer() {
+      thread_local thread_buffer_owner owner;
+      return *owner.buffer;
+    }
+
+    void write_json_string(std::ostream &os, const char *s) {
+      os << '"';
+      for (; *s; ++s) {
+        unsigned char c = static_cast<unsigned char>(*s);
+        if (c == '"' || c == '\\') {
+          os << '\\' << *s;
+        } else if (c < 0x20) {
+          static const char hex[] = "0123456789abcdef";
+          os << "\\u00" << hex[c >> 4] << hex[c & 0xf];
+        } else {
+          os << *s;
+        }
+      }
+      os << '"';
+    }
+
+    // microseconds, the unit of Chrome trace timestamps
+    void write_us(std::ostream &os, uint64_t ns) {
+      os << ns / 1000 << '.' << static_cast<char>('0' + ns / 100 % 10) << static_cast<char>('0' + ns / 10 % 10)
+         << static_cast<char>('0' + ns % 10);
+    }
+  } // namespace
+
+  std::atomic<bool> tracer::enabled_ = false;
+
+  void tracer::start() {
+    auto &r = the_registry();
+    {
+      // the spans of exited threads belong to the earlier run
+      std::lock_guard<std::mutex> lock(r.mutex);
+      r.drop_exited();
+    }
+    r.generation.fetch_add(1, std::memory_order_relaxed);
+    enabled_.store(true, std::memory_order_relaxed);
+  }
+
+  void tracer::stop() {
+    enabled_.store(false, std::memory_order_relaxed);
+  }
+
+  uint64_t tracer::now_ns() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+  }
+
+  void tracer::record(const char *name, const char *detail, uint64_t begin_ns, uint64_t end_ns) {
+    auto &b = this_thread_buffer();
+    if (b.ring.empty())
+      b.ring.resize(spans_per_thread); // published to readers by the release store of generation below
+    uint64_t generation = the_registry().generation.load(std::memory_order_relaxed);
+    if (b.generation.load(std::memory_order_relaxed) != generation) {
+      b.head.store(0, std::memory_order_relaxed);
+      b.generation.store(generation, std::memory_order_release);
+    }
+    uint64_t h = b.head.load(std::memory_order_relaxed);
+    b.ring[h % spans_per_thread] = span{name, detail, begin_ns, end_ns};
+    b.head.store(h + 1, std::memory_order_release);
+  }
+
+  const char *tracer::intern(const std::string &s) {
+    auto &r = the_registry();
+    std::lock_guard<std::mutex> lock(r.mutex);
+    return r.interned.insert(s).first->c_str();
+  }
+
+  void tracer::set_thread_name(const std::string &name) {
+    auto &b = this_thread_buffer(); // the ring is left to the first span
+    std::lock_guard<std::mutex> lock(the_registry().mutex);
+    b.thread_name = name;
+  }
+
+  void tracer::write_chrome_json(std::ostream &os) {
+    auto &r = the_registry();
+    std::vector<std::shared_ptr<thread_buffer>> buffers;
+    std::vector<std::string> thread_names;
+    {
+      std::lock_guard<std::mutex> lock(r.mutex);
+      buffers = r.buffers;
+      for (auto &b: buffers)
+        thread_names.push_back(b->thread_name);
+    }
+    uint64_t generation = r.generation.load(std::memory_order_relaxed);
+
+    os << "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[";
+    bool first = true;
+    auto separator = [&] {
+      if (!first)
+        os << ",\n";
+      first = false;
+    };
+
+    std::vector<span> spans;
+    for (size_t i = 0; i != buffers.size(); ++i) {
+      auto &b = *buffers[i];
+      if (!thread_names[i].empty()) {
+        separator();
+        os << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" << b.tid << ",\"args\":{\"name\":";
+        write_json_string(os, thread_names[i].c_str());
+        os << "}}";
+      }
+
+      if (b.generation.load(std::memory_order_acquire) != generation)
+        continue; // nothing recorded in this run
+      uint64_t end = b.head.load(std::memory_order_acquire);
+      uint64_t begin = end > spans_per_thread ? end - spans_per_thread : 0;
+      spans.clear();
+      for (uint64_t ix = begin; ix != end; ++ix)
+        spans.push_back(b.ring[ix % spans_per_thread]);
+      // drop what the thread overwrote while we copied
+      uint64_t now_head = b.head.load(std::memory_order_acquire);
+      uint64_t valid_from = now_head > spans_per_thread ? now_head - spans_per_thread : 0;
+      if (b.generation.load(std::memory_order_acquire) != generation)
+        continue;
+
+      for (uint64_t ix = std::max(begin, valid_from); ix < end; ++ix) {
+        auto &s = spans[ix - begin];
+        separator();
+        os << "{\"name\":";
+        write_json_string(os, s.name);
+        os << ",\"cat\":\"lvm2\",\"ph\":\"X\",\"pid\":1,\"tid\":" << b.tid << ",\"ts\":";
+        write_us(os, s.begin_ns);
+        os << ",\"dur\":";
+        write_us(os, s.end_ns - s.begin_ns);
+        if (s.detail) {
+          os << ",\"args\":{\"detail\":";
+          write_json_string(os, s.detail);
+          os << "}";
+        }
+        os << "}";
+      }
+    }
+    os << "]}\n";
+
+    // the spans of exited threads are written, their buffers are no longer needed
+    std::lock_guard<std::mutex> lock(r.mutex);
+    r.drop_exited();
+  }
+
+  bool tracer::write_chrome_json(const std::string &path) {
+    std::ofstream out(path);
+    if (!out)
+      return false;
+    write_chrome_json(out);
+    return static_cast<bool>(out);
+  }
+} // namespace lua_vm
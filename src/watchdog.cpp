@@ -0,0 +1,85 @@
+#include <lvm2/watchdog.h>
+#include <lvm2/executor.h>
+#include <algorithm>
+#include <glog/logging.h>
+
+namespace lua_vm {
+  watchdog::watchdog(std::chrono::microseconds period)
+      : period_(period), thread_(&watchdog::run, this) {
+  }
+
+  watchdog::~watchdog() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stop_ = true;
+    }
+    cv_.notify_one();
+    thread_.join();
+  }
+
+  void watchdog::watch(lua_script *script) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    scripts_.push_back(script);
+  }
+
+  void watchdog::unwatch(lua_script *script) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    scripts_.erase(std::remove(scripts_.begin(), scripts_.end(), script), scripts_.end());
+  }
+
+  void watchdog::run() {
+#ifdef LVM2_ENABLE_TRACING
+    tracer::set_thread_name("lvm2 watchdog");
+#endif
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (!stop_) {
+      cv_.wait_for(lock, period_);
+      if (stop_)
+        break;
+      int64_t now_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+          std::chrono::steady_clock::now().time_since_epoch()).count();
+      for (auto script: scripts_)
+        check(script, now_ns);
+    }
+  }
+
+  void watchdog::check(lua_script *script, int64_t now_ns) {
+    auto &w = script->watch;
+    uint64_t seq = w.phase_seq.load(std::memory_order_acquire);
+    if (!(seq & 1) || w.preempt_seq.load(std::memory_order_relaxed) == seq)
+      return; // idle or already being preempted
+
+    int64_t budget_ns = w.budget_ns.load(std::memory_order_relaxed);
+    // cpu time never runs ahead of wall time, only phases that are over budget in wall time need a closer look
+    bool first_look = w.cpu_begin_seq != seq;
+    if (!first_look && now_ns - w.wall_begin_ns.load(std::memory_order_relaxed) <= budget_ns)
+      return;
+
+    timespec ts;
+    if (clock_gettime(w.cpu_clock.load(std::memory_order_relaxed), &ts) != 0)
+      return;
+    int64_t cpu_now_ns = int64_t(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (w.phase_seq.load(std::memory_order_relaxed) != seq)
+      return; // the phase ended meanwhile, the clock may belong to another one
+
+    // Scripts do not read their CPU clock when a phase begins, that would be a syscall per callback. The phase's
+    // cpu time is counted from the watchdog's first look at it instead, at most one period late.
+    if (first_look) {
+      w.cpu_begin_seq = seq;
+      w.cpu_begin_ns = cpu_now_ns;
+      return;
+    }
+    int64_t cpu_ns = cpu_now_ns - w.cpu_begin_ns;
+
+    if (cpu_ns > w.hard_limit_ns.load(std::memory_order_relaxed)) {
+      LOG(WARNING) << script->name << " takes to long - preempting it...";
+      script->preempt(seq);
+    } else if (cpu_ns > budget_ns && w.overrun_seq.load(std::memory_order_relaxed) != seq) {
+      LOG(WARNING) << script->name << " exceeded its budget of " << budget_ns / 1000 << "us";
+      w.overrun_seq.store(seq, std::memory_order_relaxed);
+      script_metrics::add(script->metrics.budget_overruns);
+      script->tick_overrun = true;
+    }
+  }
+} // namespace lua_vm
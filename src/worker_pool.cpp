@@ -0,0 +1,88 @@
+#include <lvm2/worker_pool.h>
+#include <lvm2/trace.h>
+
+namespace lua_vm {
+  worker_pool::worker_pool(size_t nr_of_threads)
+      : shards_(new shard[nr_of_threads + 1]) {
+    threads_.reserve(nr_of_threads);
+    for (size_t i = 0; i != nr_of_threads; ++i)
+      threads_.emplace_back(&worker_pool::worker_main, this, i + 1); // participant 0 is the caller
+  }
+
+  worker_pool::~worker_pool() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stop_ = true;
+    }
+    start_cv_.notify_all();
+    for (auto &t: threads_)
+      t.join();
+  }
+
+  void worker_pool::parallel_for(size_t n, const std::function<void(size_t)> &fn) {
+    if (n == 0)
+      return;
+
+    if (threads_.empty()) {
+      for (size_t ix = 0; ix != n; ++ix)
+        fn(ix);
+      return;
+    }
+
+    const size_t parts = nr_of_participants();
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      for (size_t p = 0; p != parts; ++p) {
+        shards_[p].next.store(n * p / parts, std::memory_order_relaxed);
+        shards_[p].end = n * (p + 1) / parts;
+      }
+      job_ = &fn;
+      busy_ = threads_.size();
+      ++generation_;
+    }
+    start_cv_.notify_all();
+
+    run_participant(0);
+
+    std::unique_lock<std::mutex> lock(mutex_);
+    done_cv_.wait(lock, [this] { return busy_ == 0; });
+    job_ = nullptr;
+  }
+
+  void worker_pool::worker_main(size_t participant) {
+#ifdef LVM2_ENABLE_TRACING
+    tracer::set_thread_name("lvm2 worker " + std::to_string(participant));
+#endif
+    uint64_t seen = 0;
+    for (;;) {
+      {
+        std::unique_lock<std::mutex> lock(mutex_);
+        start_cv_.wait(lock, [&] { return stop_ || generation_ != seen; });
+        if (stop_)
+          return;
+        seen = generation_;
+      }
+
+      run_participant(participant);
+
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (--busy_ == 0)
+        done_cv_.notify_one();
+    }
+  }
+
+  void worker_pool::run_participant(size_t participant) {
+    const auto &job = *job_;
+    const size_t parts = nr_of_participants();
+    // own shard first, then steal from the others
+    for (size_t k = 0; k != parts; ++k) {
+      auto &s = shards_[(participant + k) % parts];
+      for (;;) {
+        size_t ix = s.next.fetch_add(1, std::memory_order_relaxed);
+        if (ix >= s.end)
+          break;
+        job(ix);
+      }
+    }
+  }
+} // namespace lua_vm
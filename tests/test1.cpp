@@ -1,6 +1,14 @@
 #include <lvm2/executor.h>
+#include <lvm2/delayed_actuator.h>
+#include <lvm2/lua_bind.h>
+#include <lvm2/typed_signal_table.h>
+#include <atomic>
 #include <chrono>
+#include <filesystem>
+#include <fstream>
+#include <sstream>
 #include <thread>
+#include <unistd.h>
 #include <gtest/gtest.h>
 #include <glog/logging.h>
 #include "test_dataplane.h"
@@ -33,6 +41,78 @@ TEST(TimerTest, TimerFunctionality) {
   ASSERT_TRUE(periodicTimer.elapsed());
 }
 
+TEST(DeadlineQueueTest, PopsDueInOrder) {
+  deadline_queue<int> q;
+  auto t0 = std::chrono::steady_clock::now();
+  q.push(t0 + std::chrono::milliseconds(30), 3, 0);
+  q.push(t0 + std::chrono::milliseconds(10), 1, 0);
+  q.push(t0 + std::chrono::milliseconds(20), 2, 0);
+  ASSERT_EQ(q.next_deadline(), t0 + std::chrono::milliseconds(10));
+
+  std::vector<deadline_queue<int>::entry> due;
+  q.pop_due(t0, due);
+  ASSERT_TRUE(due.empty());
+  q.pop_due(t0 + std::chrono::milliseconds(20), due);
+  ASSERT_EQ(due.size(), 2u);
+  ASSERT_EQ(due[0].key, 1);
+  ASSERT_EQ(due[1].key, 2);
+  ASSERT_EQ(q.size(), 1u);
+
+  q.remove_if([](auto &e) { return e.key == 3; });
+  ASSERT_TRUE(q.empty());
+}
+
+TEST(SignalTableTest, InternsNamesToDenseHandles) {
+  signal_table<int64_t> table;
+  auto speed = table.intern("vehicle.Speed", 10);
+  auto door = table.intern("vehicle.Cabin.Door.Row1.Left.IsOpen");
+  ASSERT_EQ(speed, 0u);
+  ASSERT_EQ(door, 1u);
+  ASSERT_EQ(table.intern("vehicle.Speed"), speed);
+  ASSERT_EQ(table.get(speed), 10);
+
+  table.set(std::string_view("vehicle.Speed"), 42);
+  ASSERT_EQ(table.get(speed), 42);
+  ASSERT_EQ(table.name(door), "vehicle.Cabin.Door.Row1.Left.IsOpen");
+  ASSERT_THROW(table.handle("vehicle.Unknown"), std::out_of_range);
+  ASSERT_THROW(table.checked(2), std::out_of_range);
+}
+
+TEST(SignalTableTest, ConsistentSnapshotsWhileWriting) {
+  signal_table<int64_t> table;
+  const int nr_of_signals = 64;
+  for (int i = 0; i != nr_of_signals; ++i)
+    table.intern("s" + std::to_string(i), 0);
+
+  // the writer keeps all signals equal, a torn read would see two different values
+  std::atomic<bool> done = false;
+  std::thread writer([&] {
+    for (int64_t v = 1; v <= 20000; ++v)
+      for (uint32_t h = 0; h != nr_of_signals; ++h)
+        table.set(h, v);
+    done = true;
+  });
+
+  std::vector<int64_t> values;
+  uint64_t version = 0;
+  while (!done) {
+    table.snapshot(values);
+    ASSERT_EQ(values.size(), (size_t) nr_of_signals);
+    for (auto v: values)
+      ASSERT_TRUE(v == values[0] || v == values[0] - 1);
+    version = table.changes_since(version, [](auto, auto) {});
+  }
+  writer.join();
+
+  int changed = 0;
+  table.changes_since(0, [&](auto h, auto v) {
+    ++changed;
+    EXPECT_EQ(v, 20000);
+  });
+  EXPECT_EQ(changed, nr_of_signals);
+  EXPECT_EQ(table.changes_since(table.version(), [](auto, auto) { FAIL(); }), table.version());
+}
+
 // Unit tests for executor class
 TEST(ExecutorTest, ExecutorFunctionality) {
   auto executor = executor::make_unique();
@@ -149,6 +229,27 @@ TEST(ExecutorTest, TestDataplane2) {
 }
 
 
+TEST(ExecutorTest, DataplaneHandles) {
+  auto db = test_database::make_unique();
+  auto executor = executor::make_unique([&](auto L) {
+    test_database::bind_lua(L, db.get());
+  });
+  db->set("speed", 7);
+  std::string test_script = R"(
+        local speed = db.handle("speed")
+
+        function init()
+           db.set(speed, db.get(speed) * 6)
+        end
+
+        function loop()
+        end
+    )";
+  EXPECT_TRUE(executor->loadScriptFromBuffer(test_script));
+  EXPECT_EQ(db->get("speed"), 42);
+  EXPECT_EQ(db->get(db->handle("speed")), 42);
+}
+
 TEST(ExecutorTest, Coroutines) {
   auto db = test_database::make_unique();
   auto executor = executor::make_unique([&](auto L) {
@@ -279,6 +380,1404 @@ TEST(ExecutorTest, EternalLoopInCoroutines) {
   EXPECT_EQ(executor->get_nr_of_scripts(), 0);
 }
 
+TEST(ExecutorTest, TimersOnlyFireWhenDue) {
+  auto db = test_database::make_unique();
+  auto executor = executor::make_unique([&](auto L) {
+    test_database::bind_lua(L, db.get());
+  });
+  std::string test_script = R"(
+     function init()
+        db.set("fired", 0)
+        db.set("stopped_fired", 0)
+        -- lots of idle timers
+        for i = 1, 1000 do
+           timer.open()
+        end
+        local t = timer.open()
+        timer.subscribe(t, function(id) db.set("fired", db.get("fired") + 1) end)
+        timer.elapse_after(t, 20)
+        -- re-armed and then stopped, the queued deadlines must not fire
+        local s = timer.open()
+        timer.subscribe(s, function(id) db.set("stopped_fired", 1) end)
+        timer.elapse_after(s, 10)
+        timer.elapse_after(s, 15)
+        timer.stop(s)
+     end
+
+     function loop()
+     end
+    )";
+  EXPECT_TRUE(executor->loadScriptFromBuffer(test_script));
+  executor->run_loop();
+  EXPECT_EQ(db->get("fired"), 0);
+  std::this_thread::sleep_for(std::chrono::milliseconds(30));
+  executor->run_loop();
+  executor->run_loop();
+  EXPECT_EQ(db->get("fired"), 1);
+  EXPECT_EQ(db->get("stopped_fired"), 0);
+}
+
+TEST(ExecutorTest, RunUntilSleepsToNextDeadline) {
+  auto db = test_database::make_unique();
+  auto executor = executor::make_unique([&](auto L) {
+    test_database::bind_lua(L, db.get());
+  });
+  std::string test_script = R"(
+     function init()
+        db.set("fired", 0)
+        local t = timer.open()
+        timer.subscribe(t, function(id) db.set("fired", db.get("fired") + 1) end)
+        timer.elapse_after(t, 30)
+     end
+
+     function loop()
+     end
+    )";
+  EXPECT_TRUE(executor->loadScriptFromBuffer(test_script));
+
+  auto t0 = std::chrono::steady_clock::now();
+  executor->run_until(t0 + std::chrono::milliseconds(100), std::chrono::milliseconds(0));
+  EXPECT_GE(std::chrono::steady_clock::now() - t0, std::chrono::milliseconds(100));
+  EXPECT_EQ(db->get("fired"), 1);
+  // first tick, the timer tick and the tick at the deadline - not a busy loop
+  EXPECT_LE(executor->get_total_ops(), 5);
+}
+
+TEST(ExecutorTest, RunForeverStopsFromOtherThread) {
+  auto executor = executor::make_unique();
+  std::string test_script = R"(
+     function init()
+     end
+
+     function loop()
+     end
+    )";
+  EXPECT_TRUE(executor->loadScriptFromBuffer(test_script));
+
+  std::thread runner([&] { executor->run_forever(std::chrono::milliseconds(0)); });
+  std::this_thread::sleep_for(std::chrono::milliseconds(20));
+  auto ops = executor->get_total_ops();
+  executor->wake();
+  std::this_thread::sleep_for(std::chrono::milliseconds(20));
+  executor->stop();
+  runner.join();
+  EXPECT_GT(executor->get_total_ops(), ops);
+}
+
+TEST(ExecutorTest, SleepingTasksAreNotResumed) {
+  auto db = test_database::make_unique();
+  auto executor = executor::make_unique([&](auto L) {
+    test_database::bind_lua(L, db.get());
+  });
+  std::string test_script = R"(
+     local function worker(key, period)
+        while true do
+           db.set(key, db.get(key) + 1)
+           asleep(period)
+        end
+     end
+
+     function init()
+        db.set("resumes", 0)
+        task.spawn(worker, "resumes", 50)
+        db.set("done", 0)
+        task.spawn(function()
+           await(function() return db.get("go") == 1 end)
+           db.set("done", 1)
+        end)
+     end
+
+     function loop()
+     end
+    )";
+  db->set("go", 0);
+  EXPECT_TRUE(executor->loadScriptFromBuffer(test_script));
+  for (int i = 0; i != 10; ++i)
+    executor->run_loop();
+  EXPECT_EQ(db->get("resumes"), 1);
+  EXPECT_EQ(db->get("done"), 0);
+
+  // a dataplane that never calls notify_change(): the condition is checked again after 100 ms
+  db->set("go", 1);
+  std::this_thread::sleep_for(std::chrono::milliseconds(120));
+  executor->run_loop();
+  EXPECT_EQ(db->get("resumes"), 2);
+  EXPECT_EQ(db->get("done"), 1);
+  EXPECT_EQ(executor->get_nr_of_scripts(), 1);
+}
+
+TEST(ExecutorTest, AwaitParksUntilSomethingChanged) {
+  auto db = test_database::make_unique();
+  auto executor = executor::make_unique([&](auto L) {
+    test_database::bind_lua(L, db.get());
+  });
+  int go = executor->event_open("go");
+  std::string test_script = R"(
+     local went = false
+
+     function init()
+        event.subscribe(event.open("go"), function(id) went = true end)
+        task.spawn(function()
+           await(function()
+              db.set("checks", db.get("checks") + 1)
+              return went
+           end)
+           db.set("done", 1)
+        end)
+        task.spawn(function()
+           while true do
+              coroutine.yield()
+              db.set("yields", db.get("yields") + 1)
+           end
+        end)
+     end
+
+     function loop()
+     end
+    )";
+  db->set("checks", 0);
+  db->set("yields", 0);
+  db->set("done", 0);
+  EXPECT_TRUE(executor->loadScriptFromBuffer(test_script));
+  for (int i = 0; i != 10; ++i)
+    executor->run_loop();
+  EXPECT_EQ(db->get("checks"), 1); // not polled
+  EXPECT_EQ(db->get("done"), 0);
+
+  executor->notify_change();
+  executor->run_loop();
+  EXPECT_EQ(db->get("checks"), 2);
+  EXPECT_EQ(db->get("done"), 0);
+
+  executor->post_event(go);
+  executor->run_loop();
+  EXPECT_EQ(db->get("checks"), 3);
+  EXPECT_EQ(db->get("done"), 1);
+
+  // a busy yielding task is resumed by ticks that happen anyway, it does not keep run_until() awake
+  auto yields = db->get("yields");
+  executor->run_until(std::chrono::steady_clock::now() + std::chrono::milliseconds(50), std::chrono::milliseconds(0));
+  EXPECT_LE(db->get("yields") - yields, 3);
+}
+
+TEST(ExecutorTest, ErrorInTask) {
+  auto executor = executor::make_unique();
+  std::string test_script = R"(
+     function init()
+        task.spawn(function()
+           asleep(1)
+           error("task failed")
+        end)
+     end
+
+     function loop()
+     end
+    )";
+  EXPECT_TRUE(executor->loadScriptFromBuffer(test_script));
+  executor->run_loop();
+  EXPECT_EQ(executor->get_nr_of_scripts(), 1);
+  std::this_thread::sleep_for(std::chrono::milliseconds(5));
+  executor->run_loop();
+  EXPECT_EQ(executor->get_nr_of_scripts(), 0);
+}
+
+TEST(ExecutorTest, PrewarmedStatesAndChunkCache) {
+  auto db = test_database::make_unique();
+  auto cache_dir = std::filesystem::temp_directory_path() / ("lvm2-chunks-" + std::to_string(getpid()));
+  std::string test_script = R"(
+     function init()
+        db.set("instances", db.get("instances") + 1)
+     end
+
+     function loop()
+     end
+    )";
+  db->set("instances", 0);
+  {
+    auto executor = executor::make_unique([&](auto L) {
+      test_database::bind_lua(L, db.get());
+    });
+    executor->set_chunk_cache_dir(cache_dir.string());
+    executor->prewarm_states(2);
+    for (int i = 0; i != 3; ++i)
+      EXPECT_TRUE(executor->loadScriptFromBuffer(test_script));
+    EXPECT_EQ(executor->get_nr_of_scripts(), 3);
+    EXPECT_EQ(executor->get_chunk_cache().misses(), 1);
+    EXPECT_EQ(executor->get_chunk_cache().hits(), 2);
+  }
+  {
+    // a restarted executor finds the compiled chunk on disk
+    auto executor = executor::make_unique([&](auto L) {
+      test_database::bind_lua(L, db.get());
+    });
+    executor->set_chunk_cache_dir(cache_dir.string());
+    EXPECT_TRUE(executor->loadScriptFromBuffer(test_script));
+    EXPECT_EQ(executor->get_chunk_cache().misses(), 0);
+    EXPECT_EQ(executor->get_chunk_cache().hits(), 1);
+  }
+  EXPECT_EQ(db->get("instances"), 4);
+  std::filesystem::remove_all(cache_dir);
+}
+
+TEST(ExecutorTest, InvalidChunkCacheFilesAreIgnored) {
+  auto db = test_database::make_unique();
+  auto cache_dir = std::filesystem::temp_directory_path() / ("lvm2-bad-chunks-" + std::to_string(getpid()));
+  std::string test_script = R"(
+     function init()
+        db.set("instances", db.get("instances") + 1)
+     end
+
+     function loop()
+     end
+    )";
+  db->set("instances", 0);
+  auto load = [&] {
+    auto executor = executor::make_unique([&](auto L) {
+      test_database::bind_lua(L, db.get());
+    });
+    executor->set_chunk_cache_dir(cache_dir.string());
+    EXPECT_TRUE(executor->loadScriptFromBuffer(test_script));
+    return executor->get_chunk_cache().misses();
+  };
+  EXPECT_EQ(load(), 1);
+  // a short write and raw bytecode without the header, neither may reach the undumper
+  for (auto &entry: std::filesystem::directory_iterator(cache_dir)) {
+    std::filesystem::resize_file(entry.path(), std::filesystem::file_size(entry.path()) / 2);
+  }
+  EXPECT_EQ(load(), 1);
+  for (auto &entry: std::filesystem::directory_iterator(cache_dir)) {
+    std::ofstream(entry.path(), std::ios::binary | std::ios::trunc) << "\x1bLua garbage";
+  }
+  EXPECT_EQ(load(), 1);
+  EXPECT_EQ(load(), 0);
+  EXPECT_EQ(db->get("instances"), 4);
+  std::filesystem::remove_all(cache_dir);
+}
+
+TEST(ExecutorTest, ChunkCacheIsBounded) {
+  // beyond the memory limit the least recently used chunks are dropped, the newest always stays
+  chunk_cache cache("", 1);
+  lua_State *L = luaL_newstate();
+  for (int i = 0; i != 3; ++i) {
+    EXPECT_EQ(cache.load(L, "return " + std::to_string(i), "chunk"), LUA_OK);
+    lua_pop(L, 1);
+  }
+  EXPECT_EQ(cache.size(), 1);
+  EXPECT_EQ(cache.misses(), 3);
+  EXPECT_EQ(cache.load(L, "return 2", "chunk"), LUA_OK);
+  EXPECT_EQ(cache.hits(), 1);
+  lua_close(L);
+
+  // the chunk of removed scripts is released once no instance is left
+  auto executor = executor::make_unique();
+  std::string failing = R"(
+     function init()
+     end
+
+     function loop()
+        error("gone")
+     end
+    )";
+  EXPECT_TRUE(executor->loadScriptFromBuffer(failing));
+  EXPECT_TRUE(executor->loadScriptFromBuffer(failing));
+  // without a loop function the script is rejected and its chunk released right away
+  EXPECT_FALSE(executor->loadScriptFromBuffer("function init() end"));
+  EXPECT_EQ(executor->get_chunk_cache().size(), 1);
+  executor->run_loop();
+  EXPECT_EQ(executor->get_nr_of_scripts(), 0);
+  EXPECT_EQ(executor->get_chunk_cache().size(), 0);
+  EXPECT_EQ(executor->get_chunk_cache().bytes(), 0);
+}
+
+TEST(ExecutorTest, ShebangScriptsThroughTheChunkCache) {
+  auto db = test_database::make_unique();
+  auto path = std::filesystem::temp_directory_path() / ("lvm2-shebang-" + std::to_string(getpid()) + ".lua");
+  // skipped as by the lua interpreter
+  std::ofstream(path) << "#!/usr/bin/env lua\nfunction init() db.set('shebang', 1) end\nfunction loop() end\n";
+  auto executor = executor::make_unique([&](auto L) {
+    test_database::bind_lua(L, db.get());
+  });
+  EXPECT_TRUE(executor->loadScriptFromFile(path.string()));
+  EXPECT_EQ(executor->get_chunk_cache().misses(), 1);
+  EXPECT_EQ(db->get("shebang"), 1);
+  std::filesystem::remove(path);
+}
+
+TEST(ExecutorTest, MemoryQuota) {
+  auto executor = executor::make_unique();
+  executor->set_script_memory_quota(1024 * 1024);
+  std::string modest = R"(
+     local t = {}
+     function init()
+     end
+
+     function loop()
+        t[#t % 100 + 1] = { 1, 2, 3 }
+     end
+    )";
+  std::string leaky = R"(
+     local t = {}
+     function init()
+     end
+
+     function loop()
+        for i = 1, 10000 do
+           t[#t + 1] = string.rep("x", 100) .. #t
+        end
+     end
+    )";
+  EXPECT_TRUE(executor->loadScriptFromBuffer(modest));
+  EXPECT_TRUE(executor->loadScriptFromBuffer(leaky));
+  for (int i = 0; i != 20; ++i)
+    executor->run_loop();
+  EXPECT_EQ(executor->get_nr_of_scripts(), 1);
+
+  auto stats = executor->get_memory_stats();
+  ASSERT_EQ(stats.size(), 1u);
+  EXPECT_GT(stats[0].bytes_in_use, 0u);
+  EXPECT_LE(stats[0].bytes_in_use, stats[0].quota);
+  EXPECT_GT(stats[0].allocations, 0u);
+}
+
+TEST(ExecutorTest, ParallelExecution) {
+  auto db = test_database::make_unique();
+  auto executor = executor::make_unique([&](auto L) {
+    test_database::bind_lua(L, db.get());
+  });
+  executor->set_worker_threads(4);
+  EXPECT_EQ(executor->get_worker_threads(), 4);
+
+  // one publisher and many subscribers living on different worker threads
+  std::string publisher = R"(
+     function init()
+        ping = event.open("ping")
+     end
+
+     function loop()
+        event.publish(ping)
+     end
+    )";
+  EXPECT_TRUE(executor->loadScriptFromBuffer(publisher));
+
+  const int nr_of_subscribers = 16;
+  for (int i = 0; i != nr_of_subscribers; ++i) {
+    std::string subscriber = R"(
+       local key = "pings)" + std::to_string(i) + R"("
+       function init()
+          db.set(key, 0)
+          event.subscribe(event.open("ping"), function(id)
+             db.set(key, db.get(key) + 1)
+          end)
+       end
+
+       function loop()
+       end
+      )";
+    EXPECT_TRUE(executor->loadScriptFromBuffer(subscriber));
+  }
+
+  // the eternal loop is evicted without disturbing the others
+  std::string runaway = R"(
+     function init()
+     end
+
+     function loop()
+        while true do
+        end
+     end
+    )";
+  EXPECT_TRUE(executor->loadScriptFromBuffer(runaway));
+  EXPECT_EQ(executor->get_nr_of_scripts(), nr_of_subscribers + 2);
+
+  for (int i = 0; i != 10; ++i)
+    executor->run_loop();
+
+  EXPECT_EQ(executor->get_nr_of_scripts(), nr_of_subscribers + 1);
+  // a publish reaches a subscriber in the tick after it was made (or the same tick if the subscriber runs later)
+  for (int i = 0; i != nr_of_subscribers; ++i) {
+    auto pings = db->get("pings" + std::to_string(i));
+    EXPECT_GE(pings, 9);
+    EXPECT_LE(pings, 10);
+  }
+}
+
+TEST(ExecutorTest, DelayedActuationPostsEvent) {
+  auto db = test_database::make_unique();
+  auto executor = executor::make_unique([&](auto L) {
+    test_database::bind_lua(L, db.get());
+  });
+
+  std::string test_script = R"(
+     function init()
+        db.set("done", 0)
+        event.subscribe(event.open("actuated"), function(id)
+           db.set("done", db.get("done") + 1)
+        end)
+     end
+
+     function loop()
+     end
+    )";
+  EXPECT_TRUE(executor->loadScriptFromBuffer(test_script));
+
+  int actuated = executor->event_open("actuated");
+  std::atomic<int> applied = 0;
+  {
+    delayed_actuator<int, int64_t> actuator([&](int key, int64_t value) {
+      db->set("door" + std::to_string(key), value);
+      ++applied;
+      executor->post_event(actuated);
+    });
+    // repeated sets of the same signal coalesce, the last value wins
+    for (int i = 0; i != 100; ++i)
+      actuator.schedule(1, i % 2, std::chrono::milliseconds(20));
+    actuator.schedule(1, 7, std::chrono::milliseconds(20));
+    actuator.schedule(2, 3, std::chrono::milliseconds(200));
+    EXPECT_EQ(actuator.nr_pending(), 2);
+    EXPECT_TRUE(actuator.is_pending(1));
+
+    // without timers and max_interval 0 only the posted event wakes the executor
+    auto t0 = std::chrono::steady_clock::now();
+    std::thread executor_thread([&] { executor->run_forever(std::chrono::milliseconds(0)); });
+    while (db->get("done") == 0 && std::chrono::steady_clock::now() - t0 < std::chrono::seconds(2))
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    executor->stop();
+    executor_thread.join();
+    EXPECT_EQ(db->get("done"), 1);
+    EXPECT_LT(std::chrono::steady_clock::now() - t0, std::chrono::milliseconds(150));
+    EXPECT_EQ(db->get("door1"), 7);
+    EXPECT_EQ(applied, 1);
+    // leaving the scope drains the pending actuation of key 2
+  }
+  EXPECT_EQ(applied, 2);
+  EXPECT_EQ(db->get("door2"), 3);
+}
+
+TEST(ExecutorTest, SignalSubscriptions) {
+  auto db = test_database::make_unique();
+  auto executor = executor::make_unique([&](auto L) {
+    test_database::bind_lua(L, db.get());
+  });
+  db->set_change_notifier([&](int eventid) {
+    executor->post_event(eventid);
+  });
+  db->set("door", 0);
+
+  std::string test_script = R"(
+     function init()
+        db.set("calls", 0)
+        db.set("seen", -1)
+        db.set("own", 0)
+        db.subscribe("door", function(value)
+           db.set("calls", db.get("calls") + 1)
+           db.set("seen", value)
+        end)
+        -- a second subscription to the same signal is called as well, as is the script's own event handler
+        db.subscribe("door", function(value) db.set("second", value) end)
+        event.subscribe(event.open("signal:door"), function(id) db.set("own", db.get("own") + 1) end)
+        assert(not pcall(db.subscribe, "no such signal", print))
+     end
+
+     function loop()
+     end
+    )";
+  EXPECT_TRUE(executor->loadScriptFromBuffer(test_script));
+
+  executor->run_loop();
+  EXPECT_EQ(db->get("calls"), 0);
+
+  // a write from another thread is delivered on the next tick
+  std::thread([&] { db->set("door", 1); }).join();
+  executor->run_loop();
+  EXPECT_EQ(db->get("calls"), 1);
+  EXPECT_EQ(db->get("seen"), 1);
+  EXPECT_EQ(db->get("second"), 1);
+  EXPECT_EQ(db->get("own"), 1);
+
+  // writing the same value is not a change
+  db->set("door", 1);
+  executor->run_loop();
+  EXPECT_EQ(db->get("calls"), 1);
+}
+
+TEST(ExecutorTest, ScriptMetrics) {
+  auto db = test_database::make_unique();
+  auto executor = executor::make_unique([&](auto L) {
+    test_database::bind_lua(L, db.get());
+  });
+
+  std::string test_script = R"(
+     function init()
+        ping = event.open("ping")
+        event.subscribe(ping, function(id) end)
+     end
+
+     function loop()
+        local x = 0
+        for i = 1, 100000 do x = x + i end
+        event.publish(ping)
+     end
+    )";
+  EXPECT_TRUE(executor->loadScriptFromBuffer(test_script, "busy"));
+  // removed in the first tick, their final metrics are kept
+  EXPECT_TRUE(executor->loadScriptFromBuffer("function init() end function loop() error('broken') end", "failing"));
+  script_budget budget;
+  budget.loop = std::chrono::milliseconds(1);
+  executor->set_script_budget("runaway", budget);
+  EXPECT_TRUE(executor->loadScriptFromBuffer("function init() end function loop() while true do end end", "runaway"));
+
+  std::vector<script_metrics::report> dumped;
+  executor->set_metrics_dump(std::chrono::milliseconds(1), [&](auto &reports) { dumped = reports; });
+  for (int i = 0; i != 5; ++i) {
+    executor->run_loop();
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+
+  auto metrics = executor->get_script_metrics();
+  ASSERT_EQ(metrics.size(), 1);
+  auto &m = metrics[0];
+  EXPECT_EQ(m.name, "busy");
+  EXPECT_EQ(m.loop_latency.count, 5);
+  EXPECT_GT(m.loop_latency.p50.count(), 0);
+  EXPECT_LE(m.loop_latency.p50, m.loop_latency.p99);
+  EXPECT_LE(m.loop_latency.p99, m.loop_latency.max);
+  EXPECT_EQ(m.events_dispatched, 4); // published in loop(), handled in the next tick
+  EXPECT_EQ(m.callback_latency.count, 4);
+  EXPECT_GE(m.instructions, 5 * 100000);
+  EXPECT_GT(m.heap_bytes, 0);
+  EXPECT_EQ(m.errors, 0);
+  ASSERT_EQ(dumped.size(), 1);
+  EXPECT_EQ(dumped[0].name, "busy");
+
+  auto &removed = executor->get_removed_script_metrics();
+  ASSERT_EQ(removed.size(), 2);
+  EXPECT_EQ(removed[0].name, "failing");
+  EXPECT_EQ(removed[0].errors, 1);
+  EXPECT_EQ(removed[0].timeouts, 0);
+  EXPECT_EQ(removed[1].name, "runaway");
+  EXPECT_EQ(removed[1].errors, 1);
+  EXPECT_EQ(removed[1].timeouts, 1);
+}
+
+TEST(ExecutorTest, TraceTicks) {
+#ifndef LVM2_ENABLE_TRACING
+  GTEST_SKIP() << "built without LVM2_ENABLE_TRACING";
+#endif
+  auto db = test_database::make_unique();
+  auto executor = executor::make_unique([&](auto L) {
+    test_database::bind_lua(L, db.get());
+  });
+  std::string test_script = R"(
+     function init()
+     end
+
+     function loop()
+     end
+    )";
+  EXPECT_TRUE(executor->loadScriptFromBuffer(test_script, "traced \"script\""));
+
+  executor->run_loop(); // not recorded
+  tracer::start();
+  for (int i = 0; i != 3; ++i)
+    executor->run_loop();
+  tracer::stop();
+  executor->run_loop(); // not recorded
+
+  std::ostringstream json;
+  tracer::write_chrome_json(json);
+  auto trace = json.str();
+  auto occurrences = [&](const std::string &what) {
+    size_t n = 0;
+    for (auto pos = trace.find(what); pos != std::string::npos; pos = trace.find(what, pos + 1))
+      ++n;
+    return n;
+  };
+  EXPECT_EQ(trace.rfind("{\"displayTimeUnit\":\"ns\",\"traceEvents\":[", 0), 0);
+  EXPECT_EQ(occurrences("\"name\":\"tick\""), 3);
+  EXPECT_EQ(occurrences("\"name\":\"loop\""), 3);
+  EXPECT_EQ(occurrences("\"name\":\"check_timers\""), 3);
+  EXPECT_EQ(occurrences("\"detail\":\"traced \\\"script\\\"\""), 4 * 3); // script, callbacks, tasks, loop
+}
+
+TEST(ExecutorTest, TracerDropsExitedThreads) {
+  tracer::start();
+  std::thread([] { tracer::set_thread_name("lvm2 idle"); }).join();
+  std::thread([] {
+    tracer::set_thread_name("lvm2 traced");
+    LVM2_TRACE_SCOPE("traced span");
+  }).join();
+  tracer::stop();
+
+  auto write = [] {
+    std::ostringstream json;
+    tracer::write_chrome_json(json);
+    return json.str();
+  };
+  auto trace = write();
+  EXPECT_EQ(trace.find("lvm2 idle"), std::string::npos); // exited without spans
+#ifdef LVM2_ENABLE_TRACING
+  EXPECT_NE(trace.find("traced span"), std::string::npos);
+#endif
+  // written once, then released
+  EXPECT_EQ(write().find("lvm2 traced"), std::string::npos);
+}
+
+TEST(ExecutorTest, SamplingProfiler) {
+  auto db = test_database::make_unique();
+  auto executor = executor::make_unique([&](auto L) {
+    test_database::bind_lua(L, db.get());
+  });
+  std::string test_script = R"(
+     local function hot()
+        local x = 0
+        for i = 1, 50000 do x = x + i end
+        return x
+     end
+
+     local function cold()
+        return 1
+     end
+
+     function init()
+     end
+
+     function loop()
+        hot()
+        cold()
+     end
+    )";
+  EXPECT_TRUE(executor->loadScriptFromBuffer(test_script, "profiled"));
+
+  executor->start_profiling(1000);
+  for (int i = 0; i != 10; ++i)
+    executor->run_loop();
+  executor->stop_profiling();
+
+  std::ostringstream folded;
+  executor->write_profile(folded);
+  auto profile = folded.str();
+  EXPECT_EQ(profile.rfind("profiled;", 0), 0) << profile;
+  EXPECT_NE(profile.find(";hot ([string \"buffer\"]:"), std::string::npos) << profile;
+  EXPECT_EQ(profile.find("cold"), std::string::npos) << profile;
+
+  // stopped: no more samples, the old ones are kept
+  executor->run_loop();
+  std::ostringstream again;
+  executor->write_profile(again);
+  EXPECT_EQ(again.str(), profile);
+}
+
+TEST(ExecutorTest, BudgetsPerPhase) {
+  auto db = test_database::make_unique();
+  auto executor = executor::make_unique([&](auto L) {
+    test_database::bind_lua(L, db.get());
+  });
+
+  // a heavy init passes the init budget, the loop budget is strict
+  script_budget budget;
+  budget.loop = std::chrono::milliseconds(2);
+  budget.tolerance = std::chrono::microseconds(500);
+  executor->set_script_budget("spinner", budget);
+  std::string spinner = R"(
+     function init()
+        local x = 0
+        for i = 1, 3000000 do x = x + i end
+     end
+
+     function loop()
+        while true do end
+     end
+    )";
+  EXPECT_TRUE(executor->loadScriptFromBuffer(spinner, "spinner"));
+  EXPECT_EQ(executor->get_nr_of_scripts(), 1);
+
+  executor->run_loop();
+  EXPECT_EQ(executor->get_nr_of_scripts(), 0);
+  // removed for the loop timeout, init() ran through
+  auto &removed = executor->get_removed_script_metrics();
+  ASSERT_EQ(removed.size(), 1);
+  EXPECT_EQ(removed[0].name, "spinner");
+  EXPECT_EQ(removed[0].timeouts, 1);
+  EXPECT_EQ(removed[0].errors, 1);
+}
+
+TEST(ExecutorTest, SoftBudgetThrottlesThenEvicts) {
+  auto db = test_database::make_unique();
+  auto executor = executor::make_unique([&](auto L) {
+    test_database::bind_lua(L, db.get());
+  });
+  script_budget budget;
+  budget.mode = script_budget::SOFT;
+  budget.loop = std::chrono::microseconds(200);
+  budget.tolerance = std::chrono::microseconds(100);
+  budget.throttle = std::chrono::milliseconds(20);
+  budget.evict_after = 3;
+  budget.hard_limit_factor = 1000;
+  executor->set_default_budget(budget);
+
+  std::string test_script = R"(
+     function init()
+        db.set("loops", 0)
+     end
+
+     function loop()
+        db.set("loops", db.get("loops") + 1)
+        local x = 0
+        for i = 1, 300000 do x = x + i end
+     end
+    )";
+  EXPECT_TRUE(executor->loadScriptFromBuffer(test_script, "slow"));
+  // runs over in every other tick only, its overruns are not consecutive
+  std::string bursty = R"(
+     function init()
+        db.set("bursts", 0)
+     end
+
+     function loop()
+        db.set("bursts", db.get("bursts") + 1)
+        if db.get("bursts") % 2 == 1 then
+           local x = 0
+           for i = 1, 300000 do x = x + i end
+        end
+     end
+    )";
+  EXPECT_TRUE(executor->loadScriptFromBuffer(bursty, "bursty"));
+
+  executor->run_loop();
+  executor->run_loop(); // throttled
+  auto metrics = executor->get_script_metrics();
+  ASSERT_EQ(metrics.size(), 2);
+  EXPECT_EQ(metrics[0].budget_overruns, 1);
+  EXPECT_EQ(metrics[0].timeouts, 0);
+  EXPECT_EQ(metrics[0].throttled_ticks, 1);
+  EXPECT_EQ(db->get("loops"), 1);
+
+  auto t0 = std::chrono::steady_clock::now();
+  while (executor->get_nr_of_scripts() == 2 && std::chrono::steady_clock::now() - t0 < std::chrono::seconds(2)) {
+    executor->run_loop();
+    std::this_thread::sleep_for(std::chrono::milliseconds(5));
+  }
+  ASSERT_EQ(executor->get_nr_of_scripts(), 1);
+  EXPECT_EQ(db->get("loops"), 3);
+  auto &removed = executor->get_removed_script_metrics();
+  ASSERT_EQ(removed.size(), 1);
+  EXPECT_EQ(removed[0].name, "slow");
+  EXPECT_EQ(removed[0].budget_overruns, 3);
+
+  // more overruns in total than evict_after, none in a row
+  while (executor->get_script_metrics()[0].budget_overruns <= budget.evict_after &&
+         std::chrono::steady_clock::now() - t0 < std::chrono::seconds(4)) {
+    executor->run_loop();
+    std::this_thread::sleep_for(std::chrono::milliseconds(5));
+  }
+  metrics = executor->get_script_metrics();
+  ASSERT_EQ(metrics.size(), 1);
+  EXPECT_EQ(metrics[0].name, "bursty");
+  EXPECT_GT(metrics[0].budget_overruns, budget.evict_after);
+}
+
+TEST(ExecutorTest, WatchdogPreemptsRunaways) {
+  auto db = test_database::make_unique();
+  auto executor = executor::make_unique([&](auto L) {
+    test_database::bind_lua(L, db.get());
+  });
+  executor->enable_watchdog(std::chrono::microseconds(500));
+  EXPECT_TRUE(executor->has_watchdog());
+
+  std::string healthy = R"(
+     function init()
+        db.set("loops", 0)
+     end
+
+     function loop()
+        local x = 0
+        for i = 1, 1000 do x = x + i end
+        db.set("loops", db.get("loops") + 1)
+     end
+    )";
+  EXPECT_TRUE(executor->loadScriptFromBuffer(healthy, "healthy"));
+
+  // the timeout raised in the coroutine is swallowed, the one raised in loop() is not
+  std::string runaway = R"(
+     function init()
+     end
+
+     function loop()
+        local spin = coroutine.wrap(function() while true do end end)
+        while true do pcall(spin) end
+     end
+    )";
+  EXPECT_TRUE(executor->loadScriptFromBuffer(runaway, "runaway"));
+
+  auto t0 = std::chrono::steady_clock::now();
+  for (int i = 0; i != 3; ++i)
+    executor->run_loop();
+  EXPECT_LT(std::chrono::steady_clock::now() - t0, std::chrono::milliseconds(500));
+
+  auto metrics = executor->get_script_metrics();
+  ASSERT_EQ(metrics.size(), 1);
+  EXPECT_EQ(metrics[0].name, "healthy");
+  EXPECT_EQ(metrics[0].instructions, 0); // ran without a count hook
+  EXPECT_EQ(db->get("loops"), 3);
+}
+
+TEST(ExecutorTest, NamedEventsAndTimersKeepTheirIds) {
+  auto db = test_database::make_unique();
+  auto executor = executor::make_unique([&](auto L) {
+    test_database::bind_lua(L, db.get());
+  });
+  int first = executor->event_open("e0");
+
+  // ids are stable across scripts, unnamed events and timers are never shared
+  std::string test_script = R"(
+     function init()
+        for i = 0, 1999 do
+           local id = event.open("e" .. i)
+           assert(event.open("e" .. i) == id)
+           assert(event.name(id) == "e" .. i)
+        end
+        db.set("e0", event.open("e0"))
+        db.set("e1999", event.open("e1999"))
+        assert(event.open("") ~= event.open(""))
+        db.set("shared", timer.open("t"))
+        assert(timer.open("t") == timer.open("t"))
+        assert(timer.open() ~= timer.open())
+     end
+
+     function loop()
+     end
+    )";
+  EXPECT_TRUE(executor->loadScriptFromBuffer(test_script));
+  EXPECT_TRUE(executor->loadScriptFromBuffer(test_script));
+  EXPECT_EQ(db->get("e0"), first);
+  EXPECT_EQ(db->get("e1999"), first + 1999);
+  EXPECT_EQ(executor->event_open("e1999"), first + 1999);
+}
+
+TEST(ExecutorTest, RemovedScriptsLeaveTheirSubscriptions) {
+  auto db = test_database::make_unique();
+  auto executor = executor::make_unique([&](auto L) {
+    test_database::bind_lua(L, db.get());
+  });
+  int ping = executor->event_open("ping");
+
+  // subscribing twice to an event or timer still delivers once
+  std::string subscriber = R"(
+     function init()
+        local ping = event.open("ping")
+        event.subscribe(ping, function(id) db.set("delivered", db.get("delivered") + 1) end)
+        event.subscribe(ping, function(id) db.set("delivered", db.get("delivered") + 1) end)
+        local t = timer.open("shared")
+        timer.open("shared")
+        timer.subscribe(t, function(id) db.set("elapsed", db.get("elapsed") + 1) end)
+        timer.elapse_after(t, 10)
+     end
+
+     function loop()
+     end
+    )";
+  std::string failing = R"(
+     function init()
+        event.subscribe(event.open("ping"), function(id) error("gone") end)
+        timer.open("shared")
+     end
+
+     function loop()
+     end
+    )";
+  db->set("delivered", 0);
+  db->set("elapsed", 0);
+  EXPECT_TRUE(executor->loadScriptFromBuffer(subscriber));
+  EXPECT_TRUE(executor->loadScriptFromBuffer(failing));
+  EXPECT_TRUE(executor->loadScriptFromBuffer(subscriber));
+  executor->post_event(ping);
+  executor->run_loop();
+  EXPECT_EQ(db->get("delivered"), 2);
+  EXPECT_EQ(executor->get_nr_of_scripts(), 2);
+
+  executor->post_event(ping);
+  executor->run_loop();
+  EXPECT_EQ(db->get("delivered"), 4);
+  std::this_thread::sleep_for(std::chrono::milliseconds(20));
+  executor->run_loop();
+  EXPECT_EQ(db->get("elapsed"), 2);
+}
+
+TEST(ExecutorTest, EventPayloads) {
+  auto db = test_database::make_unique();
+  auto executor = executor::make_unique([&](auto L) {
+    test_database::bind_lua(L, db.get());
+  });
+  int reading = executor->event_open("reading");
+
+  std::string publisher = R"(
+     function init()
+        event.publish(event.open("reading"), {speed = 42, unit = "kmh", flags = {true, false}, ratio = -0.5})
+        assert(not pcall(event.publish, event.open("reading"), print))
+     end
+
+     function loop()
+     end
+    )";
+  std::string subscriber = R"(
+     function init()
+        event.subscribe(event.open("reading"), function(id, value)
+           if type(value) == "table" then
+              assert(value.unit == "kmh" and value.flags[1] == true and value.flags[2] == false)
+              assert(value.ratio == -0.5 and math.type(value.speed) == "integer")
+              db.set("speed", value.speed)
+           elseif value == nil then
+              db.set("empty", 1)
+           else
+              db.set("speed", value)
+           end
+        end)
+     end
+
+     function loop()
+     end
+    )";
+  EXPECT_TRUE(executor->loadScriptFromBuffer(subscriber));
+  EXPECT_TRUE(executor->loadScriptFromBuffer(subscriber));
+  EXPECT_TRUE(executor->loadScriptFromBuffer(publisher));
+  executor->run_loop();
+  EXPECT_EQ(db->get("speed"), 42);
+  EXPECT_EQ(executor->get_nr_of_scripts(), 3);
+
+  executor->post_event(reading, event_payload::of(lua_Integer(-7)));
+  executor->run_loop();
+  EXPECT_EQ(db->get("speed"), -7);
+  executor->post_event(reading);
+  executor->run_loop();
+  EXPECT_EQ(db->get("empty"), 1);
+}
+
+TEST(ExecutorTest, BatchedAndLatestOnlySubscriptions) {
+  auto db = test_database::make_unique();
+  auto executor = executor::make_unique([&](auto L) {
+    test_database::bind_lua(L, db.get());
+  });
+  int sample = executor->event_open("sample");
+
+  std::string test_script = R"(
+     function init()
+        db.set("batch_calls", 0)
+        db.set("latest_calls", 0)
+        local sample = event.open("sample")
+        event.subscribe(sample, function(id, values, n)
+           db.set("batch_calls", db.get("batch_calls") + 1)
+           db.set("batch_n", n)
+           db.set("batch_first", values[1])
+           db.set("batch_last", values[n])
+        end, {batch = true})
+        local other = event.open("other")
+        event.subscribe(other, function(id, value, n)
+           db.set("latest_calls", db.get("latest_calls") + 1)
+           db.set("latest_n", n)
+           db.set("latest", value)
+        end, {latest = true})
+        assert(not pcall(event.subscribe, other, print, {batch = true, latest = true}))
+     end
+
+     function loop()
+     end
+    )";
+  EXPECT_TRUE(executor->loadScriptFromBuffer(test_script));
+  int other = executor->event_open("other");
+  for (lua_Integer i = 1; i <= 1000; ++i) {
+    executor->post_event(sample, event_payload::of(i));
+    executor->post_event(other, event_payload::of(i));
+  }
+  executor->run_loop();
+  EXPECT_EQ(db->get("batch_calls"), 1);
+  EXPECT_EQ(db->get("batch_n"), 1000);
+  EXPECT_EQ(db->get("batch_first"), 1);
+  EXPECT_EQ(db->get("batch_last"), 1000);
+  EXPECT_EQ(db->get("latest_calls"), 1);
+  EXPECT_EQ(db->get("latest_n"), 1000);
+  EXPECT_EQ(db->get("latest"), 1000);
+  EXPECT_EQ(executor->get_script_metrics()[0].events_dispatched, 2000u);
+
+  // nothing published, no call
+  executor->run_loop();
+  EXPECT_EQ(db->get("batch_calls"), 1);
+  EXPECT_EQ(db->get("latest_calls"), 1);
+}
+
+TEST(ExecutorTest, PostEventFromManyThreads) {
+  auto db = test_database::make_unique();
+  auto executor = executor::make_unique([&](auto L) {
+    test_database::bind_lua(L, db.get());
+  });
+  int sample = executor->event_open("sample");
+
+  std::string test_script = R"(
+     function init()
+        db.set("received", 0)
+        db.set("sum", 0)
+        event.subscribe(event.open("sample"), function(id, values, n)
+           db.set("received", db.get("received") + n)
+           local sum = db.get("sum")
+           for i = 1, n do
+              sum = sum + values[i]
+           end
+           db.set("sum", sum)
+        end, {batch = true})
+     end
+
+     function loop()
+     end
+    )";
+  EXPECT_TRUE(executor->loadScriptFromBuffer(test_script));
+
+  // max_interval 0, only the posted events wake the executor
+  std::thread executor_thread([&] { executor->run_forever(std::chrono::milliseconds(0)); });
+  const int nr_of_producers = 8;
+  const lua_Integer events_per_producer = 5000;
+  std::vector<std::thread> producers;
+  for (int p = 0; p != nr_of_producers; ++p) {
+    producers.emplace_back([&] {
+      for (lua_Integer i = 1; i <= events_per_producer; ++i)
+        executor->post_event(sample, event_payload::of(i));
+    });
+  }
+  for (auto &t: producers)
+    t.join();
+  auto t0 = std::chrono::steady_clock::now();
+  while (db->get("received") != nr_of_producers * events_per_producer &&
+         std::chrono::steady_clock::now() - t0 < std::chrono::seconds(2))
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  executor->stop();
+  executor_thread.join();
+  EXPECT_EQ(db->get("received"), nr_of_producers * events_per_producer);
+  EXPECT_EQ(db->get("sum"), nr_of_producers * events_per_producer * (events_per_producer + 1) / 2);
+}
+
+TEST(ExecutorTest, PostEventWakesSleepingExecutor) {
+  auto db = test_database::make_unique();
+  auto executor = executor::make_unique([&](auto L) {
+    test_database::bind_lua(L, db.get());
+  });
+  int ping = executor->event_open("ping");
+  std::string test_script = R"(
+     function init()
+        db.set("pings", 0)
+        event.subscribe(event.open("ping"), function(id) db.set("pings", db.get("pings") + 1) end)
+     end
+
+     function loop()
+     end
+    )";
+  EXPECT_TRUE(executor->loadScriptFromBuffer(test_script));
+
+  // one event at a time against an executor that only wakes for events, a lost wakeup would stall it for good
+  std::thread executor_thread([&] { executor->run_forever(std::chrono::milliseconds(0)); });
+  const int nr_of_events = 20000;
+  int delivered = 0;
+  for (int i = 1; i <= nr_of_events; ++i) {
+    executor->post_event(ping);
+    auto t0 = std::chrono::steady_clock::now();
+    while (db->get("pings") != i && std::chrono::steady_clock::now() - t0 < std::chrono::seconds(1))
+      std::this_thread::yield();
+    if (db->get("pings") != i)
+      break;
+    delivered = i;
+  }
+  executor->stop();
+  executor_thread.join();
+  EXPECT_EQ(delivered, nr_of_events);
+}
+
+TEST(ExecutorTest, BindingsDoNotDependOnGlobals) {
+  auto db = test_database::make_unique();
+  auto executor = executor::make_unique([&](auto L) {
+    test_database::bind_lua(L, db.get());
+  });
+
+  // scripts cannot reach or clobber the objects behind the bindings, also not from coroutines
+  std::string test_script = R"(
+     thisScript, thisExecutor, THIS_DATAPLANE = 1, 2, 3
+     function init()
+        local t = timer.open()
+        timer.subscribe(t, function(id) db.set("fired", 1) end)
+        timer.elapse_after(t, 1)
+        local co = coroutine.wrap(function()
+           db.set("from_coroutine", event.open("x") + 1)
+           coroutine.yield()
+        end)
+        co()
+        -- signal subscriptions do not go through the event global
+        local events = event
+        event = {open = function() error("hijacked") end, subscribe = function() error("hijacked") end}
+        db.subscribe("speed", function(v) db.set("speed_seen", v) end)
+        event = events
+     end
+
+     function loop()
+     end
+    )";
+  db->set("speed", 0);
+  db->set_change_notifier([&](int eventid) {
+    executor->post_event(eventid);
+  });
+  EXPECT_TRUE(executor->loadScriptFromBuffer(test_script));
+  std::this_thread::sleep_for(std::chrono::milliseconds(5));
+  executor->run_loop();
+  EXPECT_EQ(db->get("fired"), 1);
+  EXPECT_EQ(db->get("from_coroutine"), executor->event_open("x") + 1);
+  db->set("speed", 7);
+  executor->run_loop();
+  EXPECT_EQ(db->get("speed_seen"), 7);
+}
+
+// library object for the binding test
+struct bound_library {
+  std::string joined;
+
+  double scale(double v, int64_t factor) const {
+    return v * factor;
+  }
+
+  void append(std::string_view s, bool twice) {
+    joined.append(s);
+    if (twice)
+      joined.append(s);
+  }
+
+  std::string_view last() const {
+    return joined;
+  }
+
+  int64_t fail(std::string_view why) {
+    throw std::runtime_error(std::string(why));
+  }
+};
+
+TEST(ExecutorTest, BindTemplateMarshalsArguments) {
+  auto db = test_database::make_unique();
+  bound_library lib;
+  auto executor = executor::make_unique([&](auto L) {
+    test_database::bind_lua(L, db.get());
+    luaL_Reg funcs[] = {
+        lua_vm::bind<&bound_library::scale>("scale"),
+        lua_vm::bind<&bound_library::append>("append"),
+        lua_vm::bind<&bound_library::last>("last"),
+        lua_vm::bind<&bound_library::fail>("fail"),
+        {NULL, NULL}
+    };
+    lua_vm::register_library(L, "lib", funcs, &lib);
+  });
+
+  std::string test_script = R"(
+     function init()
+        assert(lib.scale(1.5, 4) == 6.0)
+        lib.append("ab", true)
+        lib.append("c", false)
+        assert(lib.last() == "ababc")
+        local ok, err = pcall(lib.fail, "broken")
+        assert(not ok and err:find("exception 'broken'", 1, true))
+        assert(not pcall(lib.scale, "x", 1))
+        db.set("ok", 1)
+     end
+
+     function loop()
+     end
+    )";
+  EXPECT_TRUE(executor->loadScriptFromBuffer(test_script));
+  EXPECT_EQ(db->get("ok"), 1);
+  EXPECT_EQ(lib.joined, "ababc");
+}
+
+// typed signals bound to Lua the way a dataplane does it
+struct typed_library {
+  lua_vm::typed_signal_table table;
+
+  int get(lua_State *L) {
+    table.lua_push(L, table.lua_check_handle(L, 1));
+    return 1;
+  }
+
+  int set(lua_State *L) {
+    auto h = table.lua_check_handle(L, 1);
+    table.set(h, table.lua_check_value(L, h, 2));
+    return 0;
+  }
+};
+
+TEST(ExecutorTest, TypedSignals) {
+  auto db = test_database::make_unique();
+  typed_library lib;
+  using lua_vm::signal_type;
+  auto speed = lib.table.add("speed", {signal_type::NUMBER, 0, 250});
+  auto door = lib.table.add("door", {signal_type::BOOLEAN});
+  auto mode = lib.table.add("mode", {signal_type::STRING, 0, 0, {"comfort", "sport"}});
+  auto note = lib.table.add("note", {signal_type::STRING});
+  auto gear = lib.table.add("gear", {signal_type::INTEGER, -1, 6});
+  EXPECT_THROW(lib.table.add("gear", {signal_type::NUMBER}), std::invalid_argument);
+  EXPECT_THROW(lib.table.add("ratio", {signal_type::INTEGER, 0.5, 0.7}), std::invalid_argument);
+  EXPECT_THROW(lib.table.set(gear, int64_t(7)), std::out_of_range);
+  EXPECT_THROW(lib.table.set(door, int64_t(1)), std::invalid_argument);
+  auto executor = executor::make_unique([&](auto L) {
+    test_database::bind_lua(L, db.get());
+    luaL_Reg funcs[] = {
+        lua_vm::bind<&typed_library::get>("get"),
+        lua_vm::bind<&typed_library::set>("set"),
+        {NULL, NULL}
+    };
+    lua_vm::register_library(L, "vss", funcs, &lib);
+  });
+
+  std::string test_script = R"(
+     function init()
+        vss.set("speed", 88.5)
+        vss.set("door", true)
+        vss.set("mode", "sport")
+        vss.set("gear", 3)
+        assert(vss.get("speed") == 88.5 and math.type(vss.get("gear")) == "integer")
+        assert(vss.get("door") == true and vss.get("mode") == "sport")
+        assert(not pcall(vss.set, "mode", "race"))
+        for i = 1, 100 do
+           vss.set("note", string.rep("x", i))
+        end
+        assert(#vss.get("note") == 100)
+        assert(not pcall(vss.set, "speed", 300))
+        assert(not pcall(vss.set, "door", 1))
+        assert(not pcall(vss.set, "gear", 2.5))
+        db.set("ok", 1)
+     end
+
+     function loop()
+     end
+    )";
+  EXPECT_TRUE(executor->loadScriptFromBuffer(test_script));
+  EXPECT_EQ(db->get("ok"), 1);
+  EXPECT_EQ(lib.table.get(speed).number, 88.5);
+  EXPECT_TRUE(lib.table.get(door).boolean);
+  EXPECT_EQ(lib.table.get(gear).integer, 3);
+  // the values of a string signal are interned once
+  auto sport = lib.table.get(mode).string;
+  EXPECT_EQ(*sport, "sport");
+  EXPECT_FALSE(lib.table.set(mode, std::string_view("sport")));
+  EXPECT_EQ(lib.table.get(mode).string, sport);
+  EXPECT_THROW(lib.table.set(mode, "race"), std::invalid_argument);
+  // a free-form string is replaced on write, a reader keeps the one it got
+  auto old_note = lib.table.get(note);
+  EXPECT_TRUE(lib.table.set(note, "replaced"));
+  EXPECT_FALSE(lib.table.set(note, "replaced"));
+  EXPECT_EQ(*old_note.string, std::string(100, 'x'));
+  EXPECT_EQ(*lib.table.get(note).string, "replaced");
+  EXPECT_EQ(old_note.blob.use_count(), 1); // the table holds only the latest
+}
+
+TEST(ExecutorTest, HotReload) {
+  auto db = test_database::make_unique();
+  auto dir = std::filesystem::temp_directory_path() / ("lvm2-scripts-" + std::to_string(getpid()));
+  std::filesystem::create_directories(dir);
+  // written under another name and renamed, the watcher never sees a half written script
+  auto write_script = [&dir](const std::string &name, const std::string &source) {
+    std::ofstream(dir / (name + ".tmp")) << source;
+    std::filesystem::rename(dir / (name + ".tmp"), dir / name);
+  };
+  auto versioned = [](int version) {
+    return R"(
+     function init()
+        db.set("version", )" + std::to_string(version) + R"()
+        event.subscribe(event.open("ping"), function(id) db.set("pings", db.get("pings") + 1) end)
+        event.subscribe(event.open("hello"), function(id) db.set("hellos", db.get("hellos") + 1) end)
+        event.publish(event.open("hello"))
+     end
+
+     function loop()
+     end
+    )";
+  };
+  write_script("versioned.lua", versioned(1));
+  write_script("other.lua", R"(
+     function init()
+        db.set("other_inits", db.get("other_inits") + 1)
+     end
+
+     function loop()
+        db.set("other_loops", db.get("other_loops") + 1)
+     end
+    )");
+  for (auto name: {"pings", "hellos", "other_inits", "other_loops"})
+    db->set(name, 0);
+  auto executor = executor::make_unique([&](auto L) {
+    test_database::bind_lua(L, db.get());
+  });
+  executor->load_scripts(dir.string());
+  executor->enable_hot_reload(dir.string());
+  EXPECT_EQ(db->get("version"), 1);
+  auto run_until_reloads = [&executor](size_t n) {
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+    while (executor->get_nr_of_reloads() < n && std::chrono::steady_clock::now() < deadline)
+      executor->run_until(std::chrono::steady_clock::now() + std::chrono::milliseconds(10));
+  };
+
+  write_script("versioned.lua", versioned(2));
+  run_until_reloads(1);
+  EXPECT_EQ(db->get("version"), 2);
+  EXPECT_EQ(executor->get_nr_of_scripts(), 2);
+  executor->post_event(executor->event_open("ping"));
+  executor->run_loop();
+  EXPECT_EQ(db->get("pings"), 1); // the old version no longer handles it
+  // the old version's queue is handed over without the hello the new init() published to both
+  EXPECT_EQ(db->get("hellos"), 2);
+  EXPECT_EQ(executor->get_chunk_cache().size(), 2); // the old version's chunk is evicted
+
+  // a broken version is not swapped in
+  write_script("versioned.lua", "function init(");
+  write_script("added.lua", versioned(3));
+  run_until_reloads(2);
+  EXPECT_EQ(db->get("version"), 3);
+  EXPECT_EQ(executor->get_nr_of_scripts(), 3);
+
+  std::filesystem::remove(dir / "added.lua");
+  run_until_reloads(3);
+  EXPECT_EQ(executor->get_nr_of_scripts(), 2);
+  EXPECT_EQ(executor->get_chunk_cache().size(), 2);
+  EXPECT_EQ(db->get("other_inits"), 1);
+  EXPECT_GT(db->get("other_loops"), 0);
+  executor.reset();
+  std::filesystem::remove_all(dir);
+}
+
+TEST(ExecutorTest, ParallelLoading) {
+  auto db = test_database::make_unique();
+  auto dir = std::filesystem::temp_directory_path() / ("lvm2-parallel-" + std::to_string(getpid()));
+  std::filesystem::create_directories(dir);
+  // the top level subscribes on the loading threads, init() records the order
+  for (int i = 8; i != 0; --i) {
+    std::ofstream(dir / ("s" + std::to_string(i) + ".lua")) << R"(
+     event.subscribe(event.open("ping"), function(id) db.set("pings", db.get("pings") + 1) end)
+
+     function init()
+        db.set("order", db.get("order") * 10 + )" << i << R"()
+     end
+
+     function loop()
+     end
+    )";
+  }
+  std::ofstream(dir / "s9.lua") << "function init(";
+  auto executor = executor::make_unique([&](auto L) {
+    test_database::bind_lua(L, db.get());
+  });
+  db->set("order", 0);
+  db->set("pings", 0);
+  executor->set_worker_threads(4);
+  executor->load_scripts(dir.string());
+  EXPECT_EQ(executor->get_nr_of_scripts(), 8);
+  EXPECT_EQ(db->get("order"), 12345678);
+
+  executor->set_worker_threads(1);
+  executor->post_event(executor->event_open("ping"));
+  executor->run_loop();
+  EXPECT_EQ(db->get("pings"), 8);
+  executor.reset();
+  std::filesystem::remove_all(dir);
+}
 
 int main(int argc, char **argv) {
   testing::InitGoogleTest(&argc, argv);
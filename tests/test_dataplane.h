@@ -1,8 +1,12 @@
-#include <map>
 #include <string>
+#include <string_view>
+#include <functional>
 #include <memory>
+#include <mutex>
 #include <vector>
 #include <lua.hpp>
+#include <lvm2/lua_bind.h>
+#include <lvm2/signal_table.h>
 #pragma once
 
 
@@ -15,20 +19,19 @@ public:
 
   static std::unique_ptr<test_database> make_unique() { return std::unique_ptr<test_database>(new test_database); }
   static void bind_lua(lua_State *L, test_database* db){
-    // Store dataplane* as userdata in Lua state
-    test_database **userdata1 = (test_database **) lua_newuserdata(L, sizeof(test_database *));
-    *userdata1 = db;
-    lua_setglobal(L, "THIS_DATAPLANE");
+    // the functions get db as upvalue, see this_lua_database()
     luaL_Reg db_funcs[] = {
-        {"get", l_get},
-        {"set", l_set},
+        lua_vm::bind<&test_database::lua_get>("get"),
+        lua_vm::bind<&test_database::lua_set>("set"),
+        lua_vm::bind<&test_database::handle>("handle"),
+        {"subscribe", l_subscribe},
         {NULL, NULL} // Sentinel to indicate the end of the array
     };
-    luaL_newlib(L, db_funcs);
-    lua_setglobal(L, "db");
+    lua_vm::register_library(L, "db", db_funcs, db);
   }
 
-  typedef std::map<std::string, int64_t> storage_type_t;
+  typedef lua_vm::signal_table<int64_t> storage_type_t;
+  typedef storage_type_t::handle_t handle_t;
 
   struct init_entry_t {
     std::string name;
@@ -37,52 +40,99 @@ public:
 
   void initialize(const std::vector<init_entry_t> &entries)
   {
+    std::lock_guard<std::mutex> lock(mutex_);
     for (const auto &entry : entries)
-      storage_[entry.name] = entry.value;
+      storage_.set(entry.name, entry.value);
   }
 
-  void set( std::string name, int64_t value){
-    storage_[name] = value;
+  // called with the event of a changed signal that scripts subscribed to, e.g. executor::post_event
+  void set_change_notifier(std::function<void(int)> notifier){
+    change_notifier_ = std::move(notifier);
   }
 
-  int64_t get( std::string name){
-    auto item = storage_.find(name);
-    if (item != storage_.end())
-      return item->second;
-    throw std::out_of_range("Element: " + name + " not found in collection");
+  void set(std::string_view name, int64_t value){
+    int eventid = -1;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      auto h = storage_.intern(name);
+      if (storage_.set(h, value))
+        eventid = storage_.event(h);
+    }
+    notify(eventid);
+  }
+
+  int64_t get(std::string_view name){
+    std::lock_guard<std::mutex> lock(mutex_);
+    return storage_.get(name);
+  }
+
+  handle_t handle(std::string_view name){
+    std::lock_guard<std::mutex> lock(mutex_);
+    return storage_.handle(name);
+  }
+
+  void set(lua_Integer handle, int64_t value){
+    int eventid = -1;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      auto h = storage_.checked(handle);
+      if (storage_.set(h, value))
+        eventid = storage_.event(h);
+    }
+    notify(eventid);
+  }
+
+  int64_t get(lua_Integer handle){
+    std::lock_guard<std::mutex> lock(mutex_);
+    return storage_.get(storage_.checked(handle));
   }
 
 private:
+  inline void notify(int eventid){
+    if (eventid >= 0 && change_notifier_)
+      change_notifier_(eventid);
+  }
+
+  // only valid in the functions registered by bind_lua()
   static inline test_database *this_lua_database(lua_State *L) {
-    lua_getglobal(L, "THIS_DATAPLANE");
-    test_database *db = *(test_database **) lua_touserdata(L, -1);
-    lua_pop(L, 1); // Pop userdata from stack
-    return db;
+    return lua_vm::bound_object<test_database>(L);
   }
 
-  static int l_set(lua_State *L){
-    try {
-      auto db = this_lua_database(L);
-      const char *name = luaL_checkstring(L, 1);
-      int64_t value = luaL_checkinteger(L, 2);
-      db->set(name, value);
-      return 0;
-    } catch (std::exception& e){
-      return luaL_error(L, "exception '%s'", e.what());
-    }
+  // Lua API, signals are addressed by handle or by name
+  void lua_set(lua_vm::handle_or_name key, int64_t value){
+    if (key.is_handle())
+      set(key.handle, value);
+    else
+      set(key.name, value);
   }
 
-  static int l_get(lua_State *L){
-    try {
-      auto db = this_lua_database(L);
-      const char *name = luaL_checkstring(L, 1);
-      int64_t value = db->get(name);
-      lua_pushinteger(L, value);
-      return 1;
-    } catch (std::exception& e){
-      return luaL_error(L, "exception '%s'", e.what());
+  int64_t lua_get(lua_vm::handle_or_name key){
+    return key.is_handle() ? get(key.handle) : get(key.name);
+  }
+
+  // db.subscribe(signal, fn), fn(value) runs when the signal changed
+  static int l_subscribe(lua_State *L){
+    auto db = this_lua_database(L);
+    // in protected mode, a Lua error raised by lua_subscribe() must not skip the unlock
+    int nargs = lua_gettop(L);
+    lua_pushlightuserdata(L, db);
+    lua_pushcclosure(L, l_subscribe_locked, 1);
+    lua_insert(L, 1);
+    int status;
+    {
+      std::lock_guard<std::mutex> lock(db->mutex_);
+      status = lua_pcall(L, nargs, 1, 0);
     }
+    if (status != LUA_OK)
+      return lua_error(L);
+    return 1;
+  }
+
+  static int l_subscribe_locked(lua_State *L){
+    return this_lua_database(L)->storage_.lua_subscribe(L);
   }
 
+  std::function<void(int)> change_notifier_;
+  std::mutex mutex_; // scripts may run on several worker threads
   storage_type_t storage_;
 };